@@ -2,6 +2,13 @@ require "mkmf"
 
 $cleanfiles += %w(*.jpg)
 dir_config("jpeg")
+have_func("clock_gettime", "time.h")
+have_header("sys/mman.h")
+have_header("ruby/ractor.h")
+have_func("rb_ext_ractor_safe", "ruby.h")
+if have_header("pthread.h") && have_library("pthread", "pthread_create")
+  have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+end
 if have_header("jpeglib.h") && have_header("jerror.h") &&
    (have_library("jpeg", "jpeg_set_defaults") ||
     have_library("libjpeg", "jpeg_set_defaults"))
@@ -28,8 +28,23 @@
 #include <ruby.h>
 #include <ruby/io.h>
 #include <ruby/st.h>
+#ifdef HAVE_RUBY_RACTOR_H
+#include <ruby/ractor.h>
+#endif
 
 #include <stdio.h>
+#include <math.h>
+#include <setjmp.h>
+#include <time.h>
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #undef HAVE_PROTOTYPES
 #undef HAVE_STDDEF_H
@@ -38,6 +53,12 @@
 #include <jpeglib.h>
 #include <jerror.h>
 
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+#define JP_PARALLEL 1
+#include <pthread.h>
+#include <ruby/thread.h>
+#endif
+
 #ifndef RSTRING_PTR
 #define RSTRING_PTR(s) (RSTRING(s)->ptr)
 #endif
@@ -45,12 +66,21 @@
 #define RSTRING_LEN(s) (RSTRING(s)->len)
 #endif
 
-#if HAVE_RB_IO_T
-#define OpenFile rb_io_t
-#endif
-
 #define MY_VERSION "0.4"
 
+#define JP_MAX_THREADS 64
+
+/* markers which jpeglib.h does not define */
+#define JP_M_SOF0	0xC0
+#define JP_M_SOF15	0xCF
+#define JP_M_DHT	0xC4
+#define JP_M_JPG	0xC8
+#define JP_M_DAC	0xCC
+#define JP_M_SOI	0xD8
+#define JP_M_SOS	0xDA
+#define JP_M_DRI	0xDD
+#define JP_M_TEM	0x01
+
 
 #define define_accessor(klass, pref, val)	\
 static VALUE					\
@@ -73,10 +103,145 @@ static VALUE mJpeg;
 static VALUE cImage;
 static VALUE eJpegError;
 static VALUE eJpegUnknownError;
+static VALUE eJpegLimitError;
+static VALUE eJpegCancelled;
 static VALUE cReader;
 static VALUE cWriter;
+static VALUE cIncDecoder;
+static VALUE cDecoder;
+static VALUE cEncoder;
+static VALUE cPlanes;
+static VALUE cCache;
+
+/* filled in Init_jpeg and never changed, so all Ractors can read it */
+static VALUE jp_err_classes[JMSG_LASTMSGCODE];
+
+enum {
+    JP_OP_READ,
+    JP_OP_WRITE,
+    JP_OP_READER_EACH,
+    JP_OP_READER_EACH_SCAN,
+    JP_OP_WRITER_EACH,
+    JP_OP_INCREMENTAL_EACH,
+    JP_OP_DECODER_READ,
+    JP_OP_ENCODER_WRITE,
+    JP_OP_BILINEAR,
+    JP_OP_BICUBIC,
+    JP_OP_CONTRAST,
+    JP_OP_GRAYSCALE,
+    JP_OP_LEVEL,
+    JP_OP_CLIP,
+    JP_OP_UNSHARP,
+    JP_OP_ROTATE,
+    JP_OP_FLIP,
+    JP_OP_FLOP,
+    JP_OP_FINGERPRINT,
+    JP_OP_MAX
+};
+
+static const char *const jp_op_names[JP_OP_MAX] = {
+    "read",
+    "write",
+    "Reader#each",
+    "Reader#each_scan",
+    "Writer#write_each_line",
+    "IncrementalDecoder#each_available_row",
+    "Decoder#read",
+    "Encoder#write",
+    "bilinear",
+    "bicubic",
+    "auto_contrast",
+    "grayscale",
+    "level",
+    "clip",
+    "unsharp",
+    "rotate",
+    "flip",
+    "flop",
+    "fingerprint",
+};
+
+struct jp_counter {
+    unsigned long calls;
+    double wall;
+    double cpu;
+    double pixels;
+    double bytes;
+};
+
+struct jp_timer {
+    int on;
+    int workers;		/* native threads worked for the call */
+    double wall;
+    double cpu;			/* of the calling thread */
+    double process;		/* of the process */
+};
+
+/*
+ * The settings are changed only by the main Ractor.
+ * The counters and the hook belong to each Ractor.
+ */
+static int jp_instrumenting = 0;
+static long jp_buffer_size = 65536;
+static long jp_max_pixels = 0;
+static long jp_max_memory = 0;
+
+#ifdef HAVE_RUBY_RACTOR_H
+static rb_ractor_local_key_t jp_counters_key;
+static rb_ractor_local_key_t jp_hook_key;
+
+static const struct rb_ractor_local_storage_type jp_counters_type = {
+    NULL,
+    ruby_xfree,
+};
+
+static struct jp_counter *
+jp_counters(void)
+{
+    struct jp_counter *cp = rb_ractor_local_storage_ptr(jp_counters_key);
+
+    if (!cp) {
+	cp = ZALLOC_N(struct jp_counter, JP_OP_MAX);
+	rb_ractor_local_storage_ptr_set(jp_counters_key, cp);
+    }
+
+    return cp;
+}
+
+static VALUE
+jp_instrument_hook(void)
+{
+    VALUE hook;
+
+    return rb_ractor_local_storage_value_lookup(jp_hook_key, &hook) ? hook : Qnil;
+}
+
+static void
+jp_set_instrument_hook(VALUE hook)
+{
+    rb_ractor_local_storage_value_set(jp_hook_key, hook);
+}
+
+/* the settings are rarely changed, so the public Ruby API is enough */
+static void
+jp_check_main_ractor(const char *name)
+{
+    VALUE ractor = rb_const_get(rb_cObject, rb_intern("Ractor"));
+
+    if (rb_funcall(ractor, rb_intern("current"), 0) != rb_funcall(ractor, rb_intern("main"), 0)) {
+	rb_raise(rb_const_get(ractor, rb_intern("UnsafeError")),
+		 "JPEG.%s can be called only from the main Ractor", name);
+    }
+}
+#else
+static struct jp_counter jp_counters_main[JP_OP_MAX];
+static VALUE jp_hook_main = Qnil;
 
-static st_table *jp_err_tbl;
+#define jp_counters() jp_counters_main
+#define jp_instrument_hook() jp_hook_main
+#define jp_set_instrument_hook(hook) (jp_hook_main = (hook))
+#define jp_check_main_ractor(name) ((void)0)
+#endif
 
 
 static void
@@ -87,7 +252,8 @@ jp_error_exit(j_common_ptr jcp)
     jpeg_abort(jcp);
     if (jcp->err->msg_code >= 0 &&
 	jcp->err->msg_code <= jcp->err->last_jpeg_message) {
-	if (!st_lookup(jp_err_tbl, jcp->err->msg_code, &err)) {
+	err = jcp->err->msg_code < JMSG_LASTMSGCODE ? jp_err_classes[jcp->err->msg_code] : 0;
+	if (!err) {
 	    err = eJpegUnknownError;
 	}
 	rb_raise(err, jcp->err->jpeg_message_table[jcp->err->msg_code],
@@ -101,949 +267,5858 @@ jp_error_exit(j_common_ptr jcp)
     }
 }
 
-static VALUE
-im_initialize(VALUE self)
+static double
+jp_wall_time(void)
 {
-    rb_iv_set(self, "raw_data", rb_str_new(NULL, 0));
-    rb_iv_set(self, "width", INT2FIX(0));
-    rb_iv_set(self, "height", INT2FIX(0));
-    rb_iv_set(self, "quality", INT2FIX(0));
-    rb_iv_set(self, "gray_p", Qfalse);
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
 
-    return self;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
 }
 
-static VALUE
-jp_s_read(VALUE klass, VALUE src)
+/*
+ * CPU time of the process, which also counts the native threads working for
+ * the call, and other threads running at the same time.
+ */
+static double
+jp_cpu_time(void)
 {
-    struct jpeg_decompress_struct dinfo;
-    struct jpeg_error_mgr jerr;
-    FILE *fp;
-    long size;
-    long offset;
-    long len;
-    VALUE obj;
-    VALUE raw_data;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
+    struct timespec ts;
 
-    if (TYPE(src) == T_FILE) {
-	OpenFile *fptr;
-	rb_io_binmode(src);
-	GetOpenFile(src, fptr);
-#ifdef GetReadFile
-	fp = GetReadFile(fptr);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 #else
-	fp = rb_io_stdio_file(fptr);
+    return (double)clock() / CLOCKS_PER_SEC;
 #endif
-    }
-    else {
-	rb_raise(rb_eTypeError, "need IO");
-    }
-
-    dinfo.err = jpeg_std_error(&jerr);
-    jerr.error_exit = jp_error_exit;
-    jpeg_create_decompress(&dinfo);
-    jpeg_stdio_src(&dinfo, fp);
-
-    jpeg_read_header(&dinfo, 1);
-    obj = rb_obj_alloc(cImage);
-    rb_obj_call_init(obj, 0, NULL);
-    rb_iv_set(obj, "width", LONG2NUM(dinfo.image_width));
-    rb_iv_set(obj, "height", LONG2NUM(dinfo.image_height));
-    rb_iv_set(obj, "quality", INT2FIX(100));	/* always 100 */
-    rb_iv_set(obj, "gray_p", dinfo.out_color_space == JCS_GRAYSCALE ? Qtrue : Qfalse);
-
-    if (dinfo.out_color_space == JCS_GRAYSCALE) {
-	dinfo.output_components = 1;
-    }
-    else {
-	dinfo.output_components = 3;
-	dinfo.out_color_space = JCS_RGB;
-    }
-    jpeg_start_decompress(&dinfo);
-    size = dinfo.image_width * dinfo.output_components;
-    len = size * dinfo.image_height;
-    raw_data = rb_iv_get(obj, "raw_data");
-    rb_str_resize(raw_data, len);
-    offset = 0;
-    while (dinfo.output_scanline < dinfo.image_height) {
-	JSAMPROW work = (JSAMPROW)&RSTRING_PTR(raw_data)[offset];
-	jpeg_read_scanlines(&dinfo, (JSAMPARRAY)&work , 1);
-	offset += size;
-    }
-
-    jpeg_finish_decompress(&dinfo);
-    jpeg_destroy_decompress(&dinfo);
-
-    return obj;
-}
-
-static inline unsigned char
-grayscale(unsigned char r, unsigned char g, unsigned char b)
-{
-    return (unsigned char)((r * 77 + g * 150 + b * 29) >> 8);
 }
 
-static VALUE
-jp_s_write(VALUE klass, VALUE obj, VALUE dest)
+/* CPU time of the calling thread, or of the process if it is unavailable */
+static double
+jp_thread_cpu_time(void)
 {
-    VALUE gray;
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    FILE *fp;
-    long size;
-    long offset;
-    VALUE raw_data;
-    long width, height;
-    int quality;
-    JSAMPROW work;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
 
-    if (TYPE(dest) == T_FILE) {
-	OpenFile *fptr;
-	rb_io_binmode(dest);
-	GetOpenFile(dest, fptr);
-#ifdef GetReadFile
-	fp = GetWriteFile(fptr);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 #else
-	fp = rb_io_stdio_file(fptr);
+    return jp_cpu_time();
 #endif
-    }
-    else {
-	rb_raise(rb_eTypeError, "need IO");
-    }
-
-    width = NUM2LONG(rb_iv_get(obj, "width"));
-    height = NUM2LONG(rb_iv_get(obj, "height"));
-    quality = FIX2INT(rb_iv_get(obj, "quality"));
-    gray = rb_iv_get(obj, "gray_p");
-    if (width <= 0 || height <= 0 || quality <= 0 || quality > 100) {
-	rb_raise(rb_eArgError, "invalid internal paramter");
-    }
-    raw_data = rb_iv_get(obj, "raw_data");
-    if (RSTRING_LEN(raw_data) < width * height * (RTEST(gray) ? 1 : 3)) {
-	rb_raise(rb_eArgError, "raw_data is smaller than width and height");
-    }
-
-    cinfo.err = jpeg_std_error(&jerr);
-    jerr.error_exit = jp_error_exit;
-    jpeg_create_compress(&cinfo);
-    jpeg_stdio_dest(&cinfo, fp);
+}
 
-    cinfo.image_width = width;
-    cinfo.image_height = height;
-    if (RTEST(gray)) {
-	cinfo.input_components = 1;
-	cinfo.in_color_space = JCS_GRAYSCALE;
+static inline void
+jp_timer_start(struct jp_timer *tp)
+{
+    tp->on = jp_instrumenting;
+    tp->workers = 0;
+    if (tp->on) {
+	tp->wall = jp_wall_time();
+	tp->cpu = jp_thread_cpu_time();
+	tp->process = jp_cpu_time();
     }
-    else {
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_RGB;
-    }
-    cinfo.progressive_mode = 1;
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, 0);
-    cinfo.optimize_coding = 1;
-    cinfo.dct_method = JDCT_ISLOW;
-    jpeg_start_compress(&cinfo, 1);
+}
 
-    size = width * cinfo.input_components;
-    offset = 0;
-    while (cinfo.next_scanline < (unsigned long)height) {
-	work = (JSAMPROW)&RSTRING_PTR(raw_data)[offset];
-	jpeg_write_scanlines(&cinfo, (JSAMPARRAY)&work , 1);
-	offset += size;
-    }
+static VALUE
+jp_counter_hash(double wall, double cpu, unsigned long calls, double pixels, double bytes)
+{
+    VALUE hash = rb_hash_new();
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    rb_hash_aset(hash, ID2SYM(rb_intern("calls")), ULONG2NUM(calls));
+    rb_hash_aset(hash, ID2SYM(rb_intern("wall_time")), rb_float_new(wall));
+    rb_hash_aset(hash, ID2SYM(rb_intern("cpu_time")), rb_float_new(cpu));
+    rb_hash_aset(hash, ID2SYM(rb_intern("pixels")), rb_dbl2big(pixels));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), rb_dbl2big(bytes));
 
-    return obj;
+    return hash;
 }
 
 static void
-get_point_bilinear(unsigned char *ptr, long width, long height, int components, double x, double y, int *r, int *g, int *b)
+jp_instrument_record(struct jp_timer *tp, int op, double pixels, double bytes)
 {
-    long x1, y1;
-    double dx, dy;
-    unsigned char c[3][4];
-    int i;
-
-    x1 = (long)x;
-    y1 = (long)y;
-    dx = x - x1;
-    dy = y - y1;
-
-    for (i = 0; i < components; ++i) {
-	c[0][i] = ptr[((x1 + 0) + (y1 + 0) * width) * components + i];
-	c[1][i] = ptr[((x1 + 1) + (y1 + 0) * width) * components + i];
-	c[2][i] = ptr[((x1 + 0) + (y1 + 1) * width) * components + i];
-	c[3][i] = ptr[((x1 + 1) + (y1 + 1) * width) * components + i];
+    struct jp_counter *cp = &jp_counters()[op];
+    VALUE hook = jp_instrument_hook();
+    double wall = jp_wall_time() - tp->wall;
+    double cpu = tp->workers ? jp_cpu_time() - tp->process : jp_thread_cpu_time() - tp->cpu;
+
+    cp->calls++;
+    cp->wall += wall;
+    cp->cpu += cpu;
+    cp->pixels += pixels;
+    cp->bytes += bytes;
+
+    if (!NIL_P(hook)) {
+	rb_funcall(hook, rb_intern("call"), 2,
+		   rb_str_new2(jp_op_names[op]),
+		   jp_counter_hash(wall, cpu, 1, pixels, bytes));
     }
+}
 
-    *r = (int)(dx * dy * (c[0][0] - c[1][0] - c[2][0] + c[3][0]) + dx * (c[1][0] - c[0][0]) + dy * (c[2][0] - c[0][0]) + c[0][0]);
-    if (components > 1) {
-	*g = (int)(dx * dy * (c[0][1] - c[1][1] - c[2][1] + c[3][1]) + dx * (c[1][1] - c[0][1]) + dy * (c[2][1] - c[0][1]) + c[0][1]);
-	*b = (int)(dx * dy * (c[0][2] - c[1][2] - c[2][2] + c[3][2]) + dx * (c[1][2] - c[0][2]) + dy * (c[2][2] - c[0][2]) + c[0][2]);
+static inline void
+jp_timer_stop(struct jp_timer *tp, int op, double pixels, double bytes)
+{
+    if (tp->on) {
+	tp->on = 0;
+	jp_instrument_record(tp, op, pixels, bytes);
     }
 }
 
-static inline double
-bicubic_weight(double d)
+/*
+ * records the call from an ensure function, if it raised or broke out of
+ * its block before jp_timer_stop. the pixels and bytes are not counted.
+ */
+static inline void
+jp_timer_ensure(struct jp_timer *tp, int op)
 {
-    double d2 = d * d;
-    double d3 = d2 * d;
-    return d < 1.0 ? (1.0 - 2.0 * d2 + d3) : d < 2.0 ? (4.0 - 8.0 * d + 5.0 * d2 - d3) : 0.0;
+    jp_timer_stop(tp, op, 0, 0);
 }
 
-static inline int
-saturate(int n, int min, int max)
+/* the arguments of a method whose body is timed by jp_timed_call */
+struct jp_timed_args {
+    int argc;
+    VALUE *argv;
+    VALUE self;
+    int op;
+    struct jp_timer tm;
+};
+
+static VALUE
+jp_timed_ensure(VALUE arg)
 {
-    return n < min ? min : n > max ? max : n;
+    struct jp_timed_args *ap = (struct jp_timed_args *)arg;
+
+    jp_timer_ensure(&ap->tm, ap->op);
+    return Qnil;
 }
 
-static void
-get_point_bicubic(unsigned char *ptr, long width, long height, int components, double dx, double dy, int *pr, int *pg, int *pb)
+/* calls body, which starts and stops ap->tm, and records it if it raises */
+static VALUE
+jp_timed_call(VALUE (*body)(VALUE), int op, int argc, VALUE *argv, VALUE self)
 {
-    long x[4], y[4];
-    long wx[4], wy[4], wt;
-    long r, g, b;
-    int i, j;
-
-    x[1] = (long)dx;
-    x[0] = x[1] - 1;
-    x[2] = x[1] + 1;
-    x[3] = x[2] + 1;
+    struct jp_timed_args args;
 
-    y[1] = (long)dy;
-    y[0] = y[1] - 1;
-    y[2] = y[1] + 1;
-    y[3] = y[2] + 1;
+    args.argc = argc;
+    args.argv = argv;
+    args.self = self;
+    args.op = op;
+    args.tm.on = 0;
 
-    wx[0] = (long)(bicubic_weight(dx - x[0]) * 1024);
-    wx[1] = (long)(bicubic_weight(dx - x[1]) * 1024);
-    wx[2] = (long)(bicubic_weight(x[2] - dx) * 1024);
-    wx[3] = (long)(bicubic_weight(x[3] - dx) * 1024);
-    wy[0] = (long)(bicubic_weight(dy - y[0]) * 1024);
-    wy[1] = (long)(bicubic_weight(dy - y[1]) * 1024);
-    wy[2] = (long)(bicubic_weight(y[2] - dy) * 1024);
-    wy[3] = (long)(bicubic_weight(y[3] - dy) * 1024);
+    return rb_ensure(body, (VALUE)&args, jp_timed_ensure, (VALUE)&args);
+}
 
-    r = g = b = 0;
-    wt = 0;
-    for (j = 0; j < 4; ++j) {
-	if (y[j] >= 0 && y[j] < height) {
-	    for (i = 0; i < 4; ++i) {
-		if (x[i] >= 0 && x[i] < width) {
-		    long w = wx[i] * wy[j];
-		    int pos = (x[i] + y[j] * width) * components;
-		    r += ptr[pos + 0] * w;
-		    if (components > 1) {
-			g += ptr[pos + 1] * w;
-			b += ptr[pos + 2] * w;
-		    }
-		    wt += w;
-		}
-	    }
-	}
-    }
 
-    *pr = saturate((int)(r / wt), 0, 255);
-    if (components > 1) {
-	*pg = saturate((int)(g / wt), 0, 255);
-	*pb = saturate((int)(b / wt), 0, 255);
-    }
+static VALUE
+jp_s_set_instrument(VALUE klass, VALUE flag)
+{
+    jp_check_main_ractor("instrument=");
+    jp_instrumenting = RTEST(flag);
+    return flag;
 }
 
-typedef void (* get_point_t)(unsigned char *, long, long, int, double, double, int *, int *, int *);
+static VALUE
+jp_s_instrument_p(VALUE klass)
+{
+    return jp_instrumenting ? Qtrue : Qfalse;
+}
 
 static VALUE
-im_resize(get_point_t get_point, VALUE self, VALUE dwidth, VALUE dheight)
+jp_s_get_instrument_hook(VALUE klass)
 {
-    long width, height;
-    long dw, dh;
-    double bx;
-    double by;
-    long x1, y1;
-    double x2, y2;
-    VALUE src;
-    VALUE dest;
-    VALUE jpeg;
-    int components;
+    return jp_instrument_hook();
+}
 
-    dw = NUM2LONG(dwidth);
-    dh = NUM2LONG(dheight);
-    width = NUM2LONG(rb_iv_get(self, "width"));
-    height = NUM2LONG(rb_iv_get(self, "height"));
-    src = rb_iv_get(self, "raw_data");
-    components = RTEST(rb_iv_get(self, "gray_p")) ? 1 : 3;
-    dest = rb_str_new(NULL, 0);
-    rb_str_resize(dest, dw * dh * components);
-    bx = (double)width / dw;
-    by = (double)height / dh;
-    for (y1 = 0, y2 = 0.0; y1 < dh; y1++) {
-	for (x1 = 0, x2 = 0.0; x1 < dw; x1++) {
-	    int r, g, b;
-	    get_point((unsigned char *)RSTRING_PTR(src), width, height, components, x2, y2, &r, &g, &b);
-	    RSTRING_PTR(dest)[(x1 + y1 * dw) * components + 0] = r;
-	    if (components > 1) {
-		RSTRING_PTR(dest)[(x1 + y1 * dw) * components + 1] = g;
-		RSTRING_PTR(dest)[(x1 + y1 * dw) * components + 2] = b;
-	    }
-	    x2 += bx;
-	}
-	y2 += by;
+static VALUE
+jp_s_set_instrument_hook(VALUE klass, VALUE hook)
+{
+    if (!NIL_P(hook) && !rb_respond_to(hook, rb_intern("call"))) {
+	rb_raise(rb_eTypeError, "hook must respond to call");
     }
+    jp_set_instrument_hook(hook);
+    return hook;
+}
 
-    jpeg = rb_class_new_instance(0, 0, cImage);
-    rb_iv_set(jpeg, "raw_data", dest);
-    rb_iv_set(jpeg, "width", LONG2NUM(dw));
-    rb_iv_set(jpeg, "height", LONG2NUM(dh));
-    rb_iv_set(jpeg, "quality", INT2FIX(100));
-    rb_iv_set(jpeg, "gray_p", rb_iv_get(self, "gray_p"));
+static VALUE
+jp_s_stats(VALUE klass)
+{
+    VALUE hash = rb_hash_new();
+    struct jp_counter *counters = jp_counters();
+    int i;
 
-    return jpeg;
+    for (i = 0; i < JP_OP_MAX; ++i) {
+	struct jp_counter *cp = &counters[i];
+	rb_hash_aset(hash, rb_str_new2(jp_op_names[i]),
+		     jp_counter_hash(cp->wall, cp->cpu, cp->calls, cp->pixels, cp->bytes));
+    }
+
+    return hash;
 }
 
 static VALUE
-im_bilinear(VALUE self, VALUE dwidth, VALUE dheight)
+jp_s_reset_stats(VALUE klass)
 {
-    return im_resize(get_point_bilinear, self, dwidth, dheight);
+    memset(jp_counters(), 0, sizeof(struct jp_counter) * JP_OP_MAX);
+    return Qnil;
 }
 
 static VALUE
-im_bicubic(VALUE self, VALUE dwidth, VALUE dheight)
+jp_opt(VALUE opts, const char *name)
 {
-    return im_resize(get_point_bicubic, self, dwidth, dheight);
+    if (NIL_P(opts)) {
+	return Qnil;
+    }
+
+    return rb_hash_aref(opts, ID2SYM(rb_intern(name)));
 }
 
-#ifndef min
-#define min(a, b) ((a) < (b) ? (a) : (b))
-#endif
-#ifndef max
-#define max(a, b) ((a) > (b) ? (a) : (b))
+static long
+jp_opt_buffer_size(VALUE opts)
+{
+    VALUE v = jp_opt(opts, "buffer_size");
+    long size;
+
+    size = NIL_P(v) ? jp_buffer_size : NUM2LONG(v);
+    if (size < 16) {
+	rb_raise(rb_eArgError, "too small buffer_size");
+    }
+
+    return size;
+}
+
+/*
+ * data source and destination through Ruby's IO methods.
+ * unlike jpeg_stdio_src/jpeg_stdio_dest, they respect the buffer of IO and
+ * Fiber.scheduler, and accept IO-like objects such as StringIO.
+ */
+struct rbio_src {
+    struct jpeg_source_mgr pub;
+    VALUE io;
+    ID meth;
+    JOCTET *buf;
+    long size;
+    double bytes;
+    int eof;
+};
+
+struct rbio_dest {
+    struct jpeg_destination_mgr pub;
+    VALUE io;
+    JOCTET *buf;
+    long size;
+    double bytes;
+};
+
+static void
+jp_binmode(VALUE io)
+{
+    if (TYPE(io) == T_FILE) {
+	rb_io_binmode(io);
+    }
+    else if (rb_respond_to(io, rb_intern("binmode"))) {
+	rb_funcall(io, rb_intern("binmode"), 0);
+    }
+}
+
+static void
+rbio_init_source(j_decompress_ptr dinfo)
+{
+}
+
+static VALUE
+rbio_read(VALUE arg)
+{
+    struct rbio_src *src = (struct rbio_src *)arg;
+
+    return rb_funcall(src->io, src->meth, 1,
+		      LONG2NUM(src->size - (long)src->pub.bytes_in_buffer));
+}
+
+static VALUE
+rbio_read_eof(VALUE arg, VALUE err)
+{
+    return Qnil;
+}
+
+/*
+ * reads more data after the unread bytes, which are moved to the head of
+ * the buffer, and returns the number of the read bytes. 0 means EOF.
+ * the unread bytes must be fewer than the buffer size.
+ * IO-like objects may return more bytes than asked for, such as the whole
+ * file, then the buffer grows to keep them.
+ */
+static long
+rbio_read_more(j_decompress_ptr dinfo)
+{
+    struct rbio_src *src = (struct rbio_src *)dinfo->src;
+    VALUE str = Qnil;
+    long len = 0, keep = (long)src->pub.bytes_in_buffer;
+
+    if (!src->eof) {
+	if (keep > 0) {
+	    memmove(src->buf, src->pub.next_input_byte, keep);
+	}
+	src->pub.next_input_byte = src->buf;
+	str = rb_rescue2(rbio_read, (VALUE)src, rbio_read_eof, Qnil,
+			 rb_eEOFError, (VALUE)0);
+	if (!NIL_P(str)) {
+	    StringValue(str);
+	    len = RSTRING_LEN(str);
+	}
+    }
+    if (len > src->size - keep) {
+	/* the old buffer stays in the pool until the source is destroyed */
+	long size = keep + len > src->size * 2 ? keep + len : src->size * 2;
+	JOCTET *buf = (JOCTET *)
+	    (*dinfo->mem->alloc_small)((j_common_ptr)dinfo, JPOOL_PERMANENT, size);
+
+	memcpy(buf, src->buf, keep);
+	src->buf = buf;
+	src->size = size;
+	src->pub.next_input_byte = buf;
+    }
+    if (len <= 0) {
+	src->eof = 1;
+	return 0;
+    }
+
+    memcpy(src->buf + keep, RSTRING_PTR(str), len);
+    RB_GC_GUARD(str);
+    src->bytes += len;
+    src->pub.bytes_in_buffer = keep + len;
+
+    return len;
+}
+
+static boolean
+rbio_fill_input_buffer(j_decompress_ptr dinfo)
+{
+    struct rbio_src *src = (struct rbio_src *)dinfo->src;
+    int eof = src->eof;
+
+    src->pub.bytes_in_buffer = 0;
+    if (rbio_read_more(dinfo) > 0) {
+	return TRUE;
+    }
+
+    /* insert a fake EOI like jdatasrc.c does */
+    if (!eof) {
+	WARNMS(dinfo, JWRN_JPEG_EOF);
+    }
+    src->buf[0] = (JOCTET)0xFF;
+    src->buf[1] = (JOCTET)JPEG_EOI;
+    src->pub.next_input_byte = src->buf;
+    src->pub.bytes_in_buffer = 2;
+
+    return TRUE;
+}
+
+static void
+rbio_skip_input_data(j_decompress_ptr dinfo, long num_bytes)
+{
+    struct jpeg_source_mgr *src = dinfo->src;
+
+    if (num_bytes <= 0) {
+	return;
+    }
+    while (num_bytes > (long)src->bytes_in_buffer) {
+	num_bytes -= (long)src->bytes_in_buffer;
+	(*src->fill_input_buffer)(dinfo);
+    }
+    src->next_input_byte += num_bytes;
+    src->bytes_in_buffer -= num_bytes;
+}
+
+static void
+rbio_term_source(j_decompress_ptr dinfo)
+{
+}
+
+static struct rbio_src *
+jp_io_src(j_decompress_ptr dinfo, VALUE io, VALUE opts)
+{
+    struct rbio_src *src;
+    ID meth;
+
+    if (rb_respond_to(io, rb_intern("readpartial"))) {
+	meth = rb_intern("readpartial");
+    }
+    else if (rb_respond_to(io, rb_intern("read"))) {
+	meth = rb_intern("read");
+    }
+    else {
+	rb_raise(rb_eTypeError, "need IO");
+    }
+    jp_binmode(io);
+
+    src = (struct rbio_src *)
+	(*dinfo->mem->alloc_small)((j_common_ptr)dinfo, JPOOL_PERMANENT,
+				   sizeof(struct rbio_src));
+    src->size = jp_opt_buffer_size(opts);
+    src->buf = (JOCTET *)
+	(*dinfo->mem->alloc_small)((j_common_ptr)dinfo, JPOOL_PERMANENT,
+				   src->size);
+    src->io = io;
+    src->meth = meth;
+    src->bytes = 0.0;
+    src->eof = 0;
+    src->pub.init_source = rbio_init_source;
+    src->pub.fill_input_buffer = rbio_fill_input_buffer;
+    src->pub.skip_input_data = rbio_skip_input_data;
+    src->pub.resync_to_restart = jpeg_resync_to_restart;
+    src->pub.term_source = rbio_term_source;
+    src->pub.next_input_byte = NULL;
+    src->pub.bytes_in_buffer = 0;
+    dinfo->src = &src->pub;
+
+    return src;
+}
+
+/* bytes which libjpeg has consumed from the source */
+static double
+jp_src_pos(j_decompress_ptr dinfo)
+{
+    struct rbio_src *src = (struct rbio_src *)dinfo->src;
+
+    return src->bytes - src->pub.bytes_in_buffer;
+}
+
+static void
+rbio_write(struct rbio_dest *dest, long len)
+{
+    rb_funcall(dest->io, rb_intern("write"), 1,
+	       rb_str_new((const char *)dest->buf, len));
+    dest->bytes += len;
+    dest->pub.next_output_byte = dest->buf;
+    dest->pub.free_in_buffer = dest->size;
+}
+
+static void
+rbio_init_destination(j_compress_ptr cinfo)
+{
+    struct rbio_dest *dest = (struct rbio_dest *)cinfo->dest;
+
+    dest->pub.next_output_byte = dest->buf;
+    dest->pub.free_in_buffer = dest->size;
+}
+
+static boolean
+rbio_empty_output_buffer(j_compress_ptr cinfo)
+{
+    rbio_write((struct rbio_dest *)cinfo->dest, ((struct rbio_dest *)cinfo->dest)->size);
+
+    return TRUE;
+}
+
+static void
+rbio_term_destination(j_compress_ptr cinfo)
+{
+    struct rbio_dest *dest = (struct rbio_dest *)cinfo->dest;
+    long len = dest->size - (long)dest->pub.free_in_buffer;
+
+    if (len > 0) {
+	rbio_write(dest, len);
+    }
+}
+
+/* data destination appended to a String, which grows as needed */
+struct str_dest {
+    struct jpeg_destination_mgr pub;
+    VALUE str;
+    long start;			/* the length before the first image */
+    int open;			/* str has the unwritten buffer */
+};
+
+static void
+str_init_destination(j_compress_ptr cinfo)
+{
+    struct str_dest *dest = (struct str_dest *)cinfo->dest;
+    long len = RSTRING_LEN(dest->str);
+
+    rb_str_resize(dest->str, len + 65536);
+    dest->open = 1;
+    dest->pub.next_output_byte = (JOCTET *)RSTRING_PTR(dest->str) + len;
+    dest->pub.free_in_buffer = 65536;
+}
+
+static boolean
+str_empty_output_buffer(j_compress_ptr cinfo)
+{
+    struct str_dest *dest = (struct str_dest *)cinfo->dest;
+    long len = RSTRING_LEN(dest->str);
+
+    rb_str_resize(dest->str, len * 2);
+    dest->pub.next_output_byte = (JOCTET *)RSTRING_PTR(dest->str) + len;
+    dest->pub.free_in_buffer = len;
+
+    return TRUE;
+}
+
+static void
+str_term_destination(j_compress_ptr cinfo)
+{
+    struct str_dest *dest = (struct str_dest *)cinfo->dest;
+
+    rb_str_set_len(dest->str, RSTRING_LEN(dest->str) - (long)dest->pub.free_in_buffer);
+    dest->pub.free_in_buffer = 0;
+    dest->open = 0;
+}
+
+/*
+ * truncates the String of pub to the length before the image, if the image
+ * was not finished. pub may be NULL or a destination of other kind.
+ */
+static void
+jp_str_dest_abort(struct jpeg_destination_mgr *pub)
+{
+    struct str_dest *dest = (struct str_dest *)pub;
+
+    if (!pub || pub->init_destination != str_init_destination || !dest->open) {
+	return;
+    }
+    dest->open = 0;
+    dest->pub.next_output_byte = NULL;
+    dest->pub.free_in_buffer = 0;
+    if (!OBJ_FROZEN(dest->str) && RSTRING_LEN(dest->str) >= dest->start) {
+	rb_str_set_len(dest->str, dest->start);
+    }
+}
+
+static void
+jp_str_dest_set(j_compress_ptr cinfo, struct str_dest *dest, VALUE str)
+{
+    rb_str_modify(str);
+    dest->str = str;
+    dest->start = RSTRING_LEN(str);
+    dest->open = 0;
+    dest->pub.init_destination = str_init_destination;
+    dest->pub.empty_output_buffer = str_empty_output_buffer;
+    dest->pub.term_destination = str_term_destination;
+    dest->pub.next_output_byte = NULL;
+    dest->pub.free_in_buffer = 0;
+    cinfo->dest = &dest->pub;
+}
+
+static void
+jp_str_dest(j_compress_ptr cinfo, VALUE str)
+{
+    struct str_dest *dest;
+
+    dest = (struct str_dest *)
+	(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT,
+				   sizeof(struct str_dest));
+    jp_str_dest_set(cinfo, dest, str);
+}
+
+/* a String is appended to, and NULL is returned for it */
+static struct rbio_dest *
+jp_io_dest(j_compress_ptr cinfo, VALUE io, VALUE opts)
+{
+    struct rbio_dest *dest;
+
+    if (RB_TYPE_P(io, T_STRING)) {
+	jp_str_dest(cinfo, io);
+	return NULL;
+    }
+    if (!rb_respond_to(io, rb_intern("write"))) {
+	rb_raise(rb_eTypeError, "need IO");
+    }
+    jp_binmode(io);
+
+    dest = (struct rbio_dest *)
+	(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT,
+				   sizeof(struct rbio_dest));
+    dest->size = jp_opt_buffer_size(opts);
+    dest->buf = (JOCTET *)
+	(*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_PERMANENT,
+				   dest->size);
+    dest->io = io;
+    dest->bytes = 0.0;
+    dest->pub.init_destination = rbio_init_destination;
+    dest->pub.empty_output_buffer = rbio_empty_output_buffer;
+    dest->pub.term_destination = rbio_term_destination;
+    dest->pub.next_output_byte = dest->buf;
+    dest->pub.free_in_buffer = dest->size;
+    cinfo->dest = &dest->pub;
+
+    return dest;
+}
+
+/* bytes which libjpeg has produced to the destination */
+static double
+jp_dest_pos(j_compress_ptr cinfo)
+{
+    struct rbio_dest *dest = (struct rbio_dest *)cinfo->dest;
+
+    if (cinfo->dest->init_destination == str_init_destination) {
+	struct str_dest *sd = (struct str_dest *)cinfo->dest;
+
+	return RSTRING_LEN(sd->str) - sd->start - (long)sd->pub.free_in_buffer;
+    }
+
+    return dest->bytes + (dest->size - (long)dest->pub.free_in_buffer);
+}
+
+/*
+ * helpers for native threads.
+ * they never call Ruby's API, so they can run without GVL.
+ */
+
+/* error manager which returns to setjmp instead of raising */
+struct jp_thread_err {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+};
+
+static void
+jp_thread_error_exit(j_common_ptr jcp)
+{
+    longjmp(((struct jp_thread_err *)jcp->err)->jmp, 1);
+}
+
+/* data destination into a malloc'ed buffer */
+struct mem_dest {
+    struct jpeg_destination_mgr pub;
+    JOCTET *buf;
+    size_t size;
+};
+
+static void
+mem_init_destination(j_compress_ptr cinfo)
+{
+    struct mem_dest *dest = (struct mem_dest *)cinfo->dest;
+
+    if (!dest->buf) {
+	dest->size = 65536;
+	dest->buf = (JOCTET *)malloc(dest->size);
+	if (!dest->buf) {
+	    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	}
+    }
+    dest->pub.next_output_byte = dest->buf;
+    dest->pub.free_in_buffer = dest->size;
+}
+
+static boolean
+mem_empty_output_buffer(j_compress_ptr cinfo)
+{
+    struct mem_dest *dest = (struct mem_dest *)cinfo->dest;
+    size_t used = dest->size;
+    JOCTET *buf;
+
+    buf = (JOCTET *)realloc(dest->buf, dest->size * 2);
+    if (!buf) {
+	ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+    }
+    dest->buf = buf;
+    dest->size *= 2;
+    dest->pub.next_output_byte = dest->buf + used;
+    dest->pub.free_in_buffer = dest->size - used;
+
+    return TRUE;
+}
+
+static void
+mem_term_destination(j_compress_ptr cinfo)
+{
+}
+
+/* dest->buf is kept over compressions, and must be released by free() */
+static void
+jp_mem_dest(j_compress_ptr cinfo, struct mem_dest *dest)
+{
+    dest->pub.init_destination = mem_init_destination;
+    dest->pub.empty_output_buffer = mem_empty_output_buffer;
+    dest->pub.term_destination = mem_term_destination;
+    cinfo->dest = &dest->pub;
+}
+
+static size_t
+jp_mem_dest_len(struct mem_dest *dest)
+{
+    return dest->size - dest->pub.free_in_buffer;
+}
+
+/* data source from memory, which must not be modified while decoding */
+struct mem_src {
+    struct jpeg_source_mgr pub;
+};
+
+static const JOCTET mem_fake_eoi[2] = {0xFF, JPEG_EOI};
+
+static void
+mem_init_source(j_decompress_ptr dinfo)
+{
+}
+
+static boolean
+mem_fill_input_buffer(j_decompress_ptr dinfo)
+{
+    WARNMS(dinfo, JWRN_JPEG_EOF);
+    dinfo->src->next_input_byte = mem_fake_eoi;
+    dinfo->src->bytes_in_buffer = 2;
+
+    return TRUE;
+}
+
+static void
+mem_skip_input_data(j_decompress_ptr dinfo, long num_bytes)
+{
+    struct jpeg_source_mgr *src = dinfo->src;
+
+    if (num_bytes <= 0) {
+	return;
+    }
+    if ((size_t)num_bytes > src->bytes_in_buffer) {
+	(*src->fill_input_buffer)(dinfo);
+    }
+    else {
+	src->next_input_byte += num_bytes;
+	src->bytes_in_buffer -= num_bytes;
+    }
+}
+
+static void
+mem_term_source(j_decompress_ptr dinfo)
+{
+}
+
+static void
+jp_mem_src(j_decompress_ptr dinfo, struct mem_src *src, const JOCTET *buf, size_t len)
+{
+    src->pub.init_source = mem_init_source;
+    src->pub.fill_input_buffer = mem_fill_input_buffer;
+    src->pub.skip_input_data = mem_skip_input_data;
+    src->pub.resync_to_restart = jpeg_resync_to_restart;
+    src->pub.term_source = mem_term_source;
+    src->pub.next_input_byte = buf;
+    src->pub.bytes_in_buffer = len;
+    dinfo->src = &src->pub;
+}
+
+typedef void (*jp_task_func)(void *arg, long task);
+
+struct jp_tasks {
+    jp_task_func func;
+    void *arg;
+    long ntasks;
+    long next;
+    int nthreads;
+    int interrupted;		/* by Thread#raise, Thread#kill or signals */
+#ifdef JP_PARALLEL
+    pthread_mutex_t lock;
 #endif
+};
+
+#ifdef JP_PARALLEL
+static void *
+jp_tasks_worker(void *p)
+{
+    struct jp_tasks *tp = (struct jp_tasks *)p;
+
+    for (;;) {
+	long i;
+
+	pthread_mutex_lock(&tp->lock);
+	i = tp->interrupted ? tp->ntasks : tp->next++;
+	pthread_mutex_unlock(&tp->lock);
+	if (i >= tp->ntasks) {
+	    break;
+	}
+	(*tp->func)(tp->arg, i);
+    }
+
+    return NULL;
+}
+
+static void *
+jp_tasks_run(void *p)
+{
+    struct jp_tasks *tp = (struct jp_tasks *)p;
+    pthread_t th[JP_MAX_THREADS];
+    int i, n = 0;
+
+    for (i = 1; i < tp->nthreads; ++i) {
+	if (pthread_create(&th[n], NULL, jp_tasks_worker, tp) == 0) {
+	    n++;
+	}
+    }
+    /* this thread works too, so all tasks are done even if no thread starts */
+    jp_tasks_worker(tp);
+    for (i = 0; i < n; ++i) {
+	pthread_join(th[i], NULL);
+    }
+
+    return NULL;
+}
+
+/* the started tasks finish, and no more task is started */
+static void
+jp_tasks_interrupt(void *p)
+{
+    struct jp_tasks *tp = (struct jp_tasks *)p;
 
+    pthread_mutex_lock(&tp->lock);
+    tp->interrupted = 1;
+    pthread_mutex_unlock(&tp->lock);
+}
+
+/*
+ * an interrupt which raises leaves here with the exception, and the
+ * callers release their buffers in ensure. others resume the rest.
+ */
 static VALUE
-im_contrast(VALUE self)
+jp_tasks_call(VALUE arg)
 {
-    VALUE jpeg;
-    long width;
-    long height;
-    VALUE src;
-    VALUE dest;
-    long x, y;
-    unsigned char min, max, median;
-    int components;
-    int low, high;
-    int i;
-    long sum, half, hist[256];
+    struct jp_tasks *tp = (struct jp_tasks *)arg;
+
+    do {
+	tp->interrupted = 0;
+	rb_thread_call_without_gvl(jp_tasks_run, tp, jp_tasks_interrupt, tp);
+    } while (tp->next < tp->ntasks);
+
+    return Qnil;
+}
+
+static VALUE
+jp_tasks_destroy(VALUE arg)
+{
+    struct jp_tasks *tp = (struct jp_tasks *)arg;
+
+    pthread_mutex_destroy(&tp->lock);
+    return Qnil;
+}
+#endif
+
+/* calls func(arg, 0) ... func(arg, ntasks - 1) on nthreads threads */
+static void
+jp_parallel(int nthreads, long ntasks, jp_task_func func, void *arg)
+{
+    long i;
+
+    if (nthreads > JP_MAX_THREADS) {
+	nthreads = JP_MAX_THREADS;
+    }
+#ifdef JP_PARALLEL
+    if (nthreads > 1 && ntasks > 1) {
+	struct jp_tasks t;
+
+	t.func = func;
+	t.arg = arg;
+	t.ntasks = ntasks;
+	t.next = 0;
+	t.nthreads = nthreads < ntasks ? nthreads : (int)ntasks;
+	pthread_mutex_init(&t.lock, NULL);
+	rb_ensure(jp_tasks_call, (VALUE)&t, jp_tasks_destroy, (VALUE)&t);
+	return;
+    }
+#endif
+    for (i = 0; i < ntasks; ++i) {
+	(*func)(arg, i);
+    }
+}
+
+/*
+ * walks the markers of a JPEG stream until SOS.
+ * returns the offset of the entropy-coded data, or -1 if it is broken.
+ * *sof is set to the offset of the length field of SOFn.
+ */
+static long
+jp_find_scan(const JOCTET *p, long len, long *sof)
+{
+    long i = 2;
+
+    *sof = -1;
+    if (len < 4 || p[0] != 0xFF || p[1] != JP_M_SOI) {
+	return -1;
+    }
+    while (i < len) {
+	int m;
+	long seg;
+
+	if (p[i] != 0xFF) {
+	    return -1;
+	}
+	while (i < len && p[i] == 0xFF) {
+	    i++;
+	}
+	if (i >= len) {
+	    return -1;
+	}
+	m = p[i++];
+	if (m == JP_M_SOI || m == JP_M_TEM ||
+	    (m >= JPEG_RST0 && m <= JPEG_RST0 + 7)) {
+	    continue;
+	}
+	if (i + 2 > len) {
+	    return -1;
+	}
+	seg = (p[i] << 8) | p[i + 1];
+	if (m >= JP_M_SOF0 && m <= JP_M_SOF15 &&
+	    m != JP_M_DHT && m != JP_M_JPG && m != JP_M_DAC) {
+	    *sof = i;
+	}
+	if (m == JP_M_SOS) {
+	    return i + seg <= len ? i + seg : -1;
+	}
+	i += seg;
+    }
+
+    return -1;
+}
+
+/*
+ * indexes the restart markers of a single scan starting at data.
+ * rst[i] is set to the offset of the i-th RSTn, and *eoi to that of EOI.
+ * returns the number of restart markers, or -1 if another marker appears
+ * or more than max markers are found.
+ */
+static long
+jp_index_restarts(const JOCTET *p, long len, long data, long *rst, long max, long *eoi)
+{
+    const JOCTET *q = p + data, *end = p + len;
+    long n = 0;
+
+    while (q < end) {
+	q = (const JOCTET *)memchr(q, 0xFF, end - q);
+	if (!q || q + 1 >= end) {
+	    break;
+	}
+	if (q[1] == 0 || q[1] == 0xFF) {
+	    q++;
+	    continue;
+	}
+	if (q[1] >= JPEG_RST0 && q[1] <= JPEG_RST0 + 7) {
+	    if (n >= max) {
+		return -1;
+	    }
+	    rst[n++] = q - p;
+	    q += 2;
+	    continue;
+	}
+	if (q[1] == JPEG_EOI) {
+	    *eoi = q - p;
+	    return n;
+	}
+	return -1;
+    }
+
+    return -1;
+}
+
+/*
+ * copies entropy-coded data and renumbers its restart markers from *rst.
+ * returns the end of the copied data in q.
+ */
+static JOCTET *
+jp_copy_scan(JOCTET *q, const JOCTET *p, long len, int *rst)
+{
+    const JOCTET *end = p + len;
+
+    while (p < end) {
+	const JOCTET *ff = (const JOCTET *)memchr(p, 0xFF, end - p);
+
+	if (!ff || ff + 1 >= end) {
+	    memcpy(q, p, end - p);
+	    q += end - p;
+	    break;
+	}
+	memcpy(q, p, ff + 1 - p);
+	q += ff + 1 - p;
+	p = ff + 1;
+	if (*p >= JPEG_RST0 && *p <= JPEG_RST0 + 7) {
+	    *q++ = (JOCTET)(JPEG_RST0 + (*rst & 7));
+	    ++*rst;
+	    ++p;
+	}
+    }
+
+    return q;
+}
+
+static VALUE
+jp_s_get_buffer_size(VALUE klass)
+{
+    return LONG2NUM(jp_buffer_size);
+}
+
+static VALUE
+jp_s_set_buffer_size(VALUE klass, VALUE size)
+{
+    jp_check_main_ractor("buffer_size=");
+    if (NUM2LONG(size) < 16) {
+	rb_raise(rb_eArgError, "too small buffer_size");
+    }
+    jp_buffer_size = NUM2LONG(size);
+
+    return size;
+}
+
+static VALUE
+jp_s_get_max_pixels(VALUE klass)
+{
+    return LONG2NUM(jp_max_pixels);
+}
+
+static VALUE
+jp_s_set_max_pixels(VALUE klass, VALUE n)
+{
+    jp_check_main_ractor("max_pixels=");
+    if (NUM2LONG(n) < 0) {
+	rb_raise(rb_eArgError, "max_pixels must not be negative");
+    }
+    jp_max_pixels = NUM2LONG(n);
+
+    return n;
+}
+
+static VALUE
+jp_s_get_max_memory(VALUE klass)
+{
+    return LONG2NUM(jp_max_memory);
+}
+
+static VALUE
+jp_s_set_max_memory(VALUE klass, VALUE n)
+{
+    jp_check_main_ractor("max_memory=");
+    if (NUM2LONG(n) < 0) {
+	rb_raise(rb_eArgError, "max_memory must not be negative");
+    }
+    jp_max_memory = NUM2LONG(n);
+
+    return n;
+}
+
+/* limit: in opts, or JPEG.max_pixels. 0 means no limit */
+static long
+jp_opt_limit(VALUE opts)
+{
+    VALUE v = jp_opt(opts, "limit");
+    long limit = NIL_P(v) ? jp_max_pixels : NUM2LONG(v);
+
+    if (limit < 0) {
+	rb_raise(rb_eArgError, "limit must not be negative");
+    }
+
+    return limit;
+}
+
+/* sets max_memory: in opts, or JPEG.max_memory to libjpeg */
+static void
+jp_set_max_memory(j_common_ptr jcp, VALUE opts)
+{
+    VALUE v = jp_opt(opts, "max_memory");
+    long max_memory = NIL_P(v) ? jp_max_memory : NUM2LONG(v);
+
+    if (max_memory < 0) {
+	rb_raise(rb_eArgError, "max_memory must not be negative");
+    }
+    if (max_memory > 0) {
+	jcp->mem->max_memory_to_use = max_memory;
+    }
+}
+
+/*
+ * checks the size in the header before allocating the pixels.
+ * dinfo is left to its owner, which destroys or aborts it.
+ */
+static void
+jp_check_limit(j_decompress_ptr dinfo, long limit)
+{
+    if (limit > 0 && (double)dinfo->image_width * dinfo->image_height > (double)limit) {
+	rb_raise(eJpegLimitError, "%lux%lu pixels exceed the limit of %ld pixels",
+		 (unsigned long)dinfo->image_width, (unsigned long)dinfo->image_height, limit);
+    }
+}
+
+static inline unsigned char
+grayscale(unsigned char r, unsigned char g, unsigned char b)
+{
+    return (unsigned char)((r * 77 + g * 150 + b * 29) >> 8);
+}
+
+/*
+ * pixel layouts of JPEG::Image.
+ * 4 byte layouts use libjpeg-turbo's extended color spaces if available,
+ * otherwise they are converted from or to RGB line by line.
+ */
+#ifdef JCS_ALPHA_EXTENSIONS
+#define JP_EXT_CS(cs)	(cs)
+#else
+#define JP_EXT_CS(cs)	JCS_UNKNOWN
+#endif
+
+struct jp_format {
+    const char *name;
+    int components;
+    int r, g, b;
+    int extra;			/* offset of alpha or padding, or -1 */
+    J_COLOR_SPACE space;
+};
+
+enum {
+    JP_FMT_RGB,
+    JP_FMT_GRAY,
+    JP_FMT_RGBA,
+    JP_FMT_BGRA,
+    JP_FMT_RGBX,
+    JP_FMT_BGRX,
+    JP_FMT_MAX
+};
+
+/* RGBA is decoded for RGBX too, so that the padding is always 0xFF */
+static const struct jp_format jp_formats[JP_FMT_MAX] = {
+    {"rgb", 3, 0, 1, 2, -1, JCS_RGB},
+    {"gray", 1, 0, 0, 0, -1, JCS_GRAYSCALE},
+    {"rgba", 4, 0, 1, 2, 3, JP_EXT_CS(JCS_EXT_RGBA)},
+    {"bgra", 4, 2, 1, 0, 3, JP_EXT_CS(JCS_EXT_BGRA)},
+    {"rgbx", 4, 0, 1, 2, 3, JP_EXT_CS(JCS_EXT_RGBA)},
+    {"bgrx", 4, 2, 1, 0, 3, JP_EXT_CS(JCS_EXT_BGRA)},
+};
+
+static const struct jp_format *
+jp_format_of(VALUE sym)
+{
+    int i;
+
+    if (SYMBOL_P(sym)) {
+	for (i = 0; i < JP_FMT_MAX; ++i) {
+	    if (SYM2ID(sym) == rb_intern(jp_formats[i].name)) {
+		return &jp_formats[i];
+	    }
+	}
+    }
+    rb_raise(rb_eArgError, "unknown format: %s", RSTRING_PTR(rb_inspect(sym)));
+
+    return NULL;		/* not reached */
+}
+
+static VALUE
+jp_format_sym(const struct jp_format *fmt)
+{
+    return ID2SYM(rb_intern(fmt->name));
+}
+
+static const struct jp_format *
+jp_image_format(VALUE img)
+{
+    return jp_format_of(rb_iv_get(img, "format"));
+}
+
+/* this never calls Ruby's API, because it is also called in native threads */
+static void
+jp_convert_row(unsigned char *q, const struct jp_format *df, const unsigned char *p, const struct jp_format *sf, long width)
+{
+    long x;
+
+    for (x = 0; x < width; ++x, p += sf->components, q += df->components) {
+	if (df->components == 1) {
+	    q[0] = sf->components == 1 ? p[0] : grayscale(p[sf->r], p[sf->g], p[sf->b]);
+	}
+	else {
+	    q[df->r] = p[sf->r];
+	    q[df->g] = p[sf->g];
+	    q[df->b] = p[sf->b];
+	    if (df->extra >= 0) {
+		q[df->extra] = sf->extra >= 0 ? p[sf->extra] : 0xFF;
+	    }
+	}
+    }
+}
+
+static VALUE
+im_initialize(VALUE self)
+{
+    rb_iv_set(self, "raw_data", rb_str_new(NULL, 0));
+    rb_iv_set(self, "width", INT2FIX(0));
+    rb_iv_set(self, "height", INT2FIX(0));
+    rb_iv_set(self, "quality", INT2FIX(0));
+    rb_iv_set(self, "format", jp_format_sym(&jp_formats[JP_FMT_RGB]));
+
+    return self;
+}
+
+static VALUE
+pl_initialize(VALUE self)
+{
+    rb_iv_set(self, "planes", rb_ary_new());
+    rb_iv_set(self, "strides", rb_ary_new());
+    rb_iv_set(self, "sampling", rb_ary_new());
+    rb_iv_set(self, "width", INT2FIX(0));
+    rb_iv_set(self, "height", INT2FIX(0));
+    rb_iv_set(self, "quality", INT2FIX(0));
+
+    return self;
+}
+
+define_accessor(cPlanes, pl, planes);
+define_accessor(cPlanes, pl, strides);
+define_accessor(cPlanes, pl, sampling);
+define_accessor(cPlanes, pl, width);
+define_accessor(cPlanes, pl, height);
+define_accessor(cPlanes, pl, quality);
+
+/*
+ * reads the downsampled components without color conversion.
+ * dinfo has read the header.
+ */
+static VALUE
+jp_read_planes(j_decompress_ptr dinfo)
+{
+    VALUE obj, planes, strides, sampling;
+    JSAMPARRAY rows[MAX_COMPONENTS];
+    JSAMPROW scratch;
+    long stride = 0;
+    int c, n = dinfo->num_components;
+
+    /* dinfo is left to its owner, which destroys it */
+    if (dinfo->jpeg_color_space != JCS_YCbCr && dinfo->jpeg_color_space != JCS_GRAYSCALE) {
+	rb_raise(eJpegError, "raw: :ycbcr needs a YCbCr or grayscale JPEG");
+    }
+    dinfo->out_color_space = dinfo->jpeg_color_space;
+    dinfo->raw_data_out = TRUE;
+    jpeg_start_decompress(dinfo);
+
+    obj = rb_obj_alloc(cPlanes);
+    rb_obj_call_init(obj, 0, NULL);
+    planes = rb_iv_get(obj, "planes");
+    strides = rb_iv_get(obj, "strides");
+    sampling = rb_iv_get(obj, "sampling");
+    rb_iv_set(obj, "width", LONG2NUM(dinfo->image_width));
+    rb_iv_set(obj, "height", LONG2NUM(dinfo->image_height));
+    rb_iv_set(obj, "quality", INT2FIX(100));	/* always 100 */
+    for (c = 0; c < n; ++c) {
+	jpeg_component_info *comp = &dinfo->comp_info[c];
+	long cs = comp->width_in_blocks * DCTSIZE;
+
+	rb_ary_push(planes, rb_str_new(NULL, cs * comp->downsampled_height));
+	rb_ary_push(strides, LONG2NUM(cs));
+	rb_ary_push(sampling, rb_assoc_new(INT2FIX(comp->h_samp_factor), INT2FIX(comp->v_samp_factor)));
+	rows[c] = (*dinfo->mem->alloc_small)((j_common_ptr)dinfo, JPOOL_IMAGE,
+		sizeof(JSAMPROW) * comp->v_samp_factor * DCTSIZE);
+	stride = stride > cs ? stride : cs;
+    }
+    /* rows in the padding of the last iMCU row are thrown away */
+    scratch = (*dinfo->mem->alloc_small)((j_common_ptr)dinfo, JPOOL_IMAGE, stride);
+
+    while (dinfo->output_scanline < dinfo->output_height) {
+	long imcu = dinfo->output_scanline / (dinfo->max_v_samp_factor * DCTSIZE);
+
+	for (c = 0; c < n; ++c) {
+	    jpeg_component_info *comp = &dinfo->comp_info[c];
+	    long cs = comp->width_in_blocks * DCTSIZE;
+	    long nrows = comp->v_samp_factor * DCTSIZE;
+	    char *ptr = RSTRING_PTR(RARRAY_AREF(planes, c));
+	    long i;
+
+	    for (i = 0; i < nrows; ++i) {
+		long y = imcu * nrows + i;
+		rows[c][i] = y < (long)comp->downsampled_height ? (JSAMPROW)(ptr + y * cs) : scratch;
+	    }
+	}
+	jpeg_read_raw_data(dinfo, rows, dinfo->max_v_samp_factor * DCTSIZE);
+    }
+
+    return obj;
+}
+
+/*
+ * writes the downsampled components without color conversion.
+ * cinfo has been set up, and its sampling factors are set from obj.
+ */
+static void
+jp_write_planes(j_compress_ptr cinfo, VALUE obj)
+{
+    VALUE planes = rb_iv_get(obj, "planes");
+    VALUE strides = rb_iv_get(obj, "strides");
+    JSAMPARRAY rows[MAX_COMPONENTS];
+    int c, n = cinfo->num_components;
+
+    cinfo->raw_data_in = TRUE;
+    jpeg_start_compress(cinfo, 1);
+    for (c = 0; c < n; ++c) {
+	jpeg_component_info *comp = &cinfo->comp_info[c];
+
+	rows[c] = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+		comp->width_in_blocks * DCTSIZE, comp->v_samp_factor * DCTSIZE);
+    }
+
+    while (cinfo->next_scanline < cinfo->image_height) {
+	long imcu = cinfo->next_scanline / (cinfo->max_v_samp_factor * DCTSIZE);
+
+	/* copies each row, and pads it to whole blocks by replicating edges */
+	for (c = 0; c < n; ++c) {
+	    jpeg_component_info *comp = &cinfo->comp_info[c];
+	    long w = (long)comp->downsampled_width;
+	    long h = (long)comp->downsampled_height;
+	    long cs = NUM2LONG(RARRAY_AREF(strides, c));
+	    long pw = comp->width_in_blocks * DCTSIZE;
+	    long nrows = comp->v_samp_factor * DCTSIZE;
+	    const unsigned char *ptr = (const unsigned char *)RSTRING_PTR(RARRAY_AREF(planes, c));
+	    long i;
+
+	    for (i = 0; i < nrows; ++i) {
+		long y = imcu * nrows + i;
+
+		memcpy(rows[c][i], ptr + (y < h ? y : h - 1) * cs, w);
+		memset(rows[c][i] + w, rows[c][i][w - 1], pw - w);
+	    }
+	}
+	jpeg_write_raw_data(cinfo, rows, cinfo->max_v_samp_factor * DCTSIZE);
+    }
+}
+
+/* checks obj and returns the number of the planes */
+static int
+jp_check_planes(VALUE obj, long width, long height)
+{
+    VALUE planes = rb_iv_get(obj, "planes");
+    VALUE strides = rb_iv_get(obj, "strides");
+    VALUE sampling = rb_iv_get(obj, "sampling");
+    int c, n, max_h = 1, max_v = 1;
+
+    Check_Type(planes, T_ARRAY);
+    Check_Type(strides, T_ARRAY);
+    Check_Type(sampling, T_ARRAY);
+    n = (int)RARRAY_LEN(planes);
+    if ((n != 1 && n != 3) || RARRAY_LEN(strides) != n || RARRAY_LEN(sampling) != n) {
+	rb_raise(rb_eArgError, "planes must be 1 or 3 with their strides and sampling");
+    }
+    for (c = 0; c < n; ++c) {
+	VALUE hv = RARRAY_AREF(sampling, c);
+	int h, v;
+
+	Check_Type(hv, T_ARRAY);
+	if (RARRAY_LEN(hv) != 2) {
+	    rb_raise(rb_eArgError, "sampling must be pairs of horizontal and vertical factors");
+	}
+	h = NUM2INT(RARRAY_AREF(hv, 0));
+	v = NUM2INT(RARRAY_AREF(hv, 1));
+	if (h < 1 || h > MAX_SAMP_FACTOR || v < 1 || v > MAX_SAMP_FACTOR) {
+	    rb_raise(rb_eArgError, "sampling factors must be between 1 to %d", MAX_SAMP_FACTOR);
+	}
+	max_h = max_h > h ? max_h : h;
+	max_v = max_v > v ? max_v : v;
+    }
+    for (c = 0; c < n; ++c) {
+	VALUE hv = RARRAY_AREF(sampling, c);
+	VALUE plane = RARRAY_AREF(planes, c);
+	long w = (width * NUM2INT(RARRAY_AREF(hv, 0)) + max_h - 1) / max_h;
+	long h = (height * NUM2INT(RARRAY_AREF(hv, 1)) + max_v - 1) / max_v;
+	long cs = NUM2LONG(RARRAY_AREF(strides, c));
+
+	StringValue(plane);
+	if (cs < w) {
+	    rb_raise(rb_eArgError, "stride is smaller than width of the plane");
+	}
+	if (RSTRING_LEN(plane) < cs * (h - 1) + w) {
+	    rb_raise(rb_eArgError, "plane is smaller than its stride and height");
+	}
+    }
+
+    return n;
+}
+
+/*
+ * sets the output color space for fmt, which is gray or RGB by the file
+ * if it is NULL. returns the format libjpeg outputs.
+ * this never calls Ruby's API, because it is also called in native threads.
+ */
+static const struct jp_format *
+jp_setup_decompress(j_decompress_ptr dinfo, const struct jp_format *fmt)
+{
+    const struct jp_format *out;
+
+    if (fmt && fmt->space != JCS_UNKNOWN) {
+	out = fmt;
+    }
+    else if (fmt ? fmt->components == 1 : dinfo->out_color_space == JCS_GRAYSCALE) {
+	out = &jp_formats[JP_FMT_GRAY];
+    }
+    else {
+	out = &jp_formats[JP_FMT_RGB];
+    }
+    dinfo->out_color_space = out->space;
+    dinfo->output_components = out->components;
+
+    return out;
+}
+
+/* reads one line as fmt, through work if libjpeg outputs another format */
+static void
+jp_read_line(j_decompress_ptr dinfo, const struct jp_format *out, const struct jp_format *fmt, JSAMPROW row, JSAMPROW work)
+{
+    if (out == fmt) {
+	jpeg_read_scanlines(dinfo, &row, 1);
+    }
+    else {
+	jpeg_read_scanlines(dinfo, &work, 1);
+	jp_convert_row(row, fmt, work, out, dinfo->output_width);
+    }
+}
+
+struct rst_dec {
+    const JOCTET *data;
+    long hdr;			/* the end of SOS segment */
+    long sof;			/* the length field of SOF */
+    long *seg;			/* the start of each interval, and the EOI */
+    long nsegs;
+    long seg_rows;		/* pixel rows of each interval */
+    long per_task;		/* intervals of each task */
+    long width;
+    long height;
+    const struct jp_format *fmt;
+    unsigned char *pixels;
+    int *failed;
+    char (*msg)[JMSG_LENGTH_MAX];
+};
+
+/*
+ * decodes the intervals of one task into its rows of the pixels.
+ * one more interval on each side is decoded, so that the upsampling
+ * around the borders is same as the serial decoding.
+ */
+static void
+rst_decode(void *arg, long t)
+{
+    struct rst_dec *rd = (struct rst_dec *)arg;
+    struct jpeg_decompress_struct dinfo;
+    struct jp_thread_err jerr;
+    struct mem_src src;
+    long first = t * rd->per_task;
+    long last = first + rd->per_task < rd->nsegs ? first + rd->per_task : rd->nsegs;
+    long from = first > 0 ? first - 1 : 0;
+    long to = last < rd->nsegs ? last + 1 : last;
+    long y0 = from * rd->seg_rows;
+    long rows = to * rd->seg_rows < rd->height ? to * rd->seg_rows - y0 : rd->height - y0;
+    long own0 = first * rd->seg_rows, own1 = last * rd->seg_rows;
+    long stride = rd->width * rd->fmt->components;
+    long len, k;
+    JOCTET *volatile buf = NULL;
+    JSAMPROW scratch = NULL, work;
+    const struct jp_format *out;
+    JOCTET *q;
+    int rst = 0;
+
+    memset(&dinfo, 0, sizeof(dinfo));
+    dinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jp_thread_error_exit;
+    if (setjmp(jerr.jmp)) {
+	(*dinfo.err->format_message)((j_common_ptr)&dinfo, rd->msg[t]);
+	rd->failed[t] = 1;
+	jpeg_destroy_decompress(&dinfo);
+	free(buf);
+	return;
+    }
+    jpeg_create_decompress(&dinfo);
+
+    /* builds a stream which has the intervals only */
+    len = rd->hdr + (rd->seg[to] - rd->seg[from]) + 2;
+    buf = (JOCTET *)malloc(len);
+    if (!buf) {
+	ERREXIT1(&dinfo, JERR_OUT_OF_MEMORY, 0);
+    }
+    memcpy(buf, rd->data, rd->hdr);
+    buf[rd->sof + 3] = (JOCTET)((rows >> 8) & 0xFF);
+    buf[rd->sof + 4] = (JOCTET)(rows & 0xFF);
+    q = buf + rd->hdr;
+    for (k = from; k < to; ++k) {
+	/* each interval but the last one ends with its RSTn */
+	long n = rd->seg[k + 1] - rd->seg[k] - (k + 1 < rd->nsegs ? 2 : 0);
+
+	if (k > from) {
+	    *q++ = 0xFF;
+	    *q++ = (JOCTET)(JPEG_RST0 + (rst & 7));
+	    rst++;
+	}
+	memcpy(q, rd->data + rd->seg[k], n);
+	q += n;
+    }
+    *q++ = 0xFF;
+    *q++ = JPEG_EOI;
+
+    jp_mem_src(&dinfo, &src, buf, q - buf);
+    jpeg_read_header(&dinfo, 1);
+    out = jp_setup_decompress(&dinfo, rd->fmt);
+    jpeg_start_decompress(&dinfo);
+    scratch = (*dinfo.mem->alloc_small)((j_common_ptr)&dinfo, JPOOL_IMAGE, rd->width * 4);
+    work = (*dinfo.mem->alloc_small)((j_common_ptr)&dinfo, JPOOL_IMAGE, rd->width * 4);
+    while (dinfo.output_scanline < dinfo.output_height) {
+	long y = y0 + dinfo.output_scanline;
+	JSAMPROW row = (y >= own0 && y < own1) ? rd->pixels + y * stride : scratch;
+
+	jp_read_line(&dinfo, out, rd->fmt, row, work);
+    }
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+    free(buf);
+}
+
+/*
+ * decodes the restart intervals of a sequential JPEG stream on native
+ * threads. dinfo has read the header of data, and fmt is the output.
+ * returns the pixels, or nil if the stream cannot be split.
+ */
+static VALUE
+jp_read_parallel(j_decompress_ptr dinfo, VALUE data, int threads, const struct jp_format *fmt)
+{
+    struct rst_dec rd;
+    const JOCTET *p = (const JOCTET *)RSTRING_PTR(data);
+    long len = RSTRING_LEN(data);
+    long mcu_w, mcu_h, mcus_per_row, mcu_rows, ntasks, eoi = 0, k;
+    int i, max_h = 1, max_v = 1;
+    VALUE pixels, tmp;
+
+    if (jpeg_has_multiple_scans(dinfo) || dinfo->restart_interval == 0 ||
+	dinfo->comps_in_scan != dinfo->num_components || dinfo->arith_code) {
+	return Qnil;
+    }
+    for (i = 0; i < dinfo->num_components; ++i) {
+	max_h = max_h > dinfo->comp_info[i].h_samp_factor ? max_h : dinfo->comp_info[i].h_samp_factor;
+	max_v = max_v > dinfo->comp_info[i].v_samp_factor ? max_v : dinfo->comp_info[i].v_samp_factor;
+    }
+    /* a non-interleaved scan has MCUs of one block */
+    mcu_w = dinfo->num_components == 1 ? DCTSIZE : max_h * DCTSIZE;
+    mcu_h = dinfo->num_components == 1 ? DCTSIZE : max_v * DCTSIZE;
+    mcus_per_row = (dinfo->image_width + mcu_w - 1) / mcu_w;
+    mcu_rows = (dinfo->image_height + mcu_h - 1) / mcu_h;
+    if (dinfo->restart_interval % mcus_per_row != 0) {
+	return Qnil;
+    }
+
+    rd.seg_rows = dinfo->restart_interval / mcus_per_row * mcu_h;
+    rd.nsegs = (mcu_rows * mcu_h + rd.seg_rows - 1) / rd.seg_rows;
+    ntasks = rd.nsegs < threads * 2 ? rd.nsegs : threads * 2;
+    if (ntasks < 2) {
+	return Qnil;
+    }
+    rd.hdr = jp_find_scan(p, len, &rd.sof);
+    if (rd.hdr < 0 || rd.sof < 0) {
+	return Qnil;
+    }
+
+    /* both buffers are kept by tmp while GVL is released */
+    tmp = rb_str_new(NULL, sizeof(long) * (rd.nsegs + 1) + JMSG_LENGTH_MAX * ntasks);
+    rd.seg = (long *)RSTRING_PTR(tmp);
+    rd.seg[0] = rd.hdr;
+    if (jp_index_restarts(p, len, rd.hdr, rd.seg + 1, rd.nsegs - 1, &eoi) != rd.nsegs - 1) {
+	/* broken or unusual files are left to the serial decoding */
+	return Qnil;
+    }
+    for (k = 1; k < rd.nsegs; ++k) {
+	rd.seg[k] += 2;
+    }
+    rd.seg[rd.nsegs] = eoi;
+
+    rd.data = p;
+    rd.width = dinfo->image_width;
+    rd.height = dinfo->image_height;
+    rd.fmt = fmt;
+    rd.per_task = (rd.nsegs + ntasks - 1) / ntasks;
+    ntasks = (rd.nsegs + rd.per_task - 1) / rd.per_task;
+    pixels = rb_str_new(NULL, rd.width * rd.height * fmt->components);
+    rd.pixels = (unsigned char *)RSTRING_PTR(pixels);
+    rd.failed = ALLOCA_N(int, ntasks);
+    rd.msg = (char (*)[JMSG_LENGTH_MAX])(rd.seg + rd.nsegs + 1);
+    memset(rd.failed, 0, sizeof(int) * ntasks);
+
+    /* data is a frozen snapshot, so nobody modifies it while GVL is released */
+    jp_parallel(threads, ntasks, rst_decode, &rd);
+    for (k = 0; k < ntasks; ++k) {
+	if (rd.failed[k]) {
+	    rb_raise(eJpegError, "%s", rd.msg[k]);
+	}
+    }
+    RB_GC_GUARD(tmp);
+
+    return pixels;
+}
+
+/*
+ * images backed by mappings.
+ * their raw_data are NOFREE strings, so Ruby copies them before modifying,
+ * and the pages are shared among forked processes until then.
+ * each mapping is owned by a hidden object in the ivar of the string and
+ * the image, and unmapped when both of them are collected.
+ */
+#define JP_DUMP_MAGIC	"RBJPEGI\001"
+#define JP_DUMP_HEADER	64
+
+static void
+jp_put_le(unsigned char *p, unsigned long v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+	p[i] = (unsigned char)((v >> (i * 8)) & 0xFF);
+    }
+}
+
+static unsigned long
+jp_get_le(const unsigned char *p, int n)
+{
+    unsigned long v = 0;
+    int i;
+
+    for (i = n - 1; i >= 0; --i) {
+	v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+struct jp_map {
+    void *addr;			/* NULL until mapped */
+    size_t len;
+};
+
+static void
+jp_map_free(void *p)
+{
+    struct jp_map *mp = (struct jp_map *)p;
+
+    if (mp->addr) {
+	munmap(mp->addr, mp->len);
+    }
+    xfree(mp);
+}
+
+static size_t
+jp_map_memsize(const void *p)
+{
+    return sizeof(struct jp_map);
+}
+
+static const rb_data_type_t jp_map_type = {
+    "JPEG::Mapping",
+    {0, jp_map_free, jp_map_memsize,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* allocated before mmap, so that the mapping is never leaked */
+static VALUE
+jp_map_new(struct jp_map **mpp)
+{
+    return TypedData_Make_Struct(0, struct jp_map, &jp_map_type, *mpp);
+}
+
+/* a NOFREE string of len bytes at ptr in the mapping of owner */
+static VALUE
+jp_map_str(VALUE obj, VALUE owner, const char *ptr, long len)
+{
+    VALUE str = rb_str_new_static(ptr, len);
+
+    rb_iv_set(str, "mapping", owner);
+    rb_iv_set(obj, "mapping", owner);
+
+    return str;
+}
+#endif
+
+/* copies str into a read-only anonymous shared mapping owned by obj */
+static VALUE
+jp_str_share(VALUE obj, VALUE str)
+{
+#ifdef HAVE_SYS_MMAN_H
+    long len = RSTRING_LEN(str);
+    struct jp_map *mp;
+    VALUE owner;
+    void *p;
+
+    if (len == 0) {
+	return str;
+    }
+    owner = jp_map_new(&mp);
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+	rb_sys_fail("mmap");
+    }
+    mp->addr = p;
+    mp->len = len;
+    memcpy(p, RSTRING_PTR(str), len);
+    /* nobody can modify the pages of other processes in place */
+    mprotect(p, len, PROT_READ);
+
+    return jp_map_str(obj, owner, (const char *)p, len);
+#else
+    return str;
+#endif
+}
+
+/*
+ * Progress and cancellation of JPEG.read and JPEG.write.
+ * libjpeg calls the monitor between the rows of each pass, and raising in
+ * it unwinds through libjpeg like the error manager does.
+ */
+struct jp_progress {
+    struct jpeg_progress_mgr pub;
+    VALUE callback;
+    VALUE cancel;
+    double deadline;		/* jp_wall_time, or 0 */
+};
+
+/* the state of JPEG.read and JPEG.write, destroyed by rb_ensure */
+struct jp_read_args {
+    int argc;
+    VALUE *argv;
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    struct jp_progress progress;
+    struct jp_timer tm;
+};
+
+struct jp_write_args {
+    int argc;
+    VALUE *argv;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct jp_progress progress;
+    struct jp_timer tm;
+};
+
+static void
+jp_progress_monitor(j_common_ptr jcp)
+{
+    struct jp_progress *pp = (struct jp_progress *)jcp->progress;
+
+    if (pp->deadline > 0 && jp_wall_time() > pp->deadline) {
+	jpeg_abort(jcp);
+	rb_raise(eJpegCancelled, "deadline exceeded");
+    }
+    if (!NIL_P(pp->cancel) && RTEST(rb_funcall(pp->cancel, rb_intern("call"), 0))) {
+	jpeg_abort(jcp);
+	rb_raise(eJpegCancelled, "cancelled");
+    }
+    if (!NIL_P(pp->callback)) {
+	rb_funcall(pp->callback, rb_intern("call"), 4,
+		   INT2NUM(pp->pub.completed_passes), INT2NUM(pp->pub.total_passes),
+		   LONG2NUM(pp->pub.pass_counter), LONG2NUM(pp->pub.pass_limit));
+    }
+}
+
+static int
+jp_progress_given(VALUE opts)
+{
+    return !NIL_P(jp_opt(opts, "progress")) || !NIL_P(jp_opt(opts, "deadline")) ||
+	!NIL_P(jp_opt(opts, "cancel"));
+}
+
+/* returns 1 if the monitor is attached */
+static int
+jp_progress_setup(j_common_ptr jcp, struct jp_progress *pp, VALUE opts)
+{
+    VALUE v;
+
+    if (!jp_progress_given(opts)) {
+	return 0;
+    }
+    pp->callback = jp_opt(opts, "progress");
+    pp->cancel = jp_opt(opts, "cancel");
+    if (!NIL_P(pp->callback) && !rb_respond_to(pp->callback, rb_intern("call"))) {
+	rb_raise(rb_eTypeError, "progress must respond to call");
+    }
+    if (!NIL_P(pp->cancel) && !rb_respond_to(pp->cancel, rb_intern("call"))) {
+	rb_raise(rb_eTypeError, "cancel must respond to call");
+    }
+    pp->deadline = 0;
+    v = jp_opt(opts, "deadline");
+    if (!NIL_P(v)) {
+	if (rb_obj_is_kind_of(v, rb_cTime)) {
+	    /* seconds from now */
+	    v = rb_funcall(v, '-', 1, rb_funcall(rb_cTime, rb_intern("now"), 0));
+	}
+	/* a deadline in the past still fails at the first check */
+	pp->deadline = jp_wall_time() + NUM2DBL(v);
+	if (pp->deadline <= 0) {
+	    pp->deadline = 1e-9;
+	}
+    }
+    pp->pub.progress_monitor = jp_progress_monitor;
+    jcp->progress = &pp->pub;
+
+    return 1;
+}
+
+/*
+ * EXIF orientations 1-8 as the transforms which display them upright:
+ * transposed, mirrored horizontally and mirrored vertically, in this order.
+ */
+static const unsigned char jp_orientations[9][3] = {
+    {0, 0, 0}, {0, 0, 0}, {0, 1, 0}, {0, 1, 1}, {0, 0, 1},
+    {1, 0, 0}, {1, 0, 1}, {1, 1, 1}, {1, 1, 0},
+};
+
+#define JP_ORIENT_ROTATE_90	6
+#define JP_ORIENT_ROTATE_180	3
+#define JP_ORIENT_ROTATE_270	8
+#define JP_ORIENT_FLIP		4
+#define JP_ORIENT_FLOP		2
+
+/* tiles of 64x64 pixels keep both the source and the destination in L1 */
+#define JP_TILE 64
+
+static unsigned long
+jp_exif_get(const JOCTET *p, int n, int le)
+{
+    unsigned long v = 0;
+    int i;
+
+    if (le) {
+	return jp_get_le(p, n);
+    }
+    for (i = 0; i < n; ++i) {
+	v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+/* Orientation in the saved APP1 markers, or 1 */
+static int
+jp_exif_orientation(j_decompress_ptr dinfo)
+{
+    jpeg_saved_marker_ptr m;
+
+    for (m = dinfo->marker_list; m; m = m->next) {
+	const JOCTET *p = m->data + 6;	/* TIFF header */
+	unsigned long len, off, n, i;
+	int le;
+
+	if (m->marker != JPEG_APP0 + 1 || m->data_length < 6 + 8 ||
+	    memcmp(m->data, "Exif\0\0", 6) != 0) {
+	    continue;
+	}
+	len = m->data_length - 6;
+	if (p[0] == 'I' && p[1] == 'I') {
+	    le = 1;
+	}
+	else if (p[0] == 'M' && p[1] == 'M') {
+	    le = 0;
+	}
+	else {
+	    continue;
+	}
+	off = jp_exif_get(p + 4, 4, le);	/* IFD0 */
+	if (off > len - 2) {
+	    continue;
+	}
+	n = jp_exif_get(p + off, 2, le);
+	for (i = 0; i < n && off + 2 + (i + 1) * 12 <= len; ++i) {
+	    const JOCTET *e = p + off + 2 + i * 12;
+
+	    /* Orientation, SHORT */
+	    if (jp_exif_get(e, 2, le) == 0x0112 && jp_exif_get(e + 2, 2, le) == 3) {
+		unsigned long v = jp_exif_get(e + 8, 2, le);
+		return v >= 1 && v <= 8 ? (int)v : 1;
+	    }
+	}
+    }
+
+    return 1;
+}
+
+static inline void
+jp_copy_pixel(unsigned char *q, const unsigned char *p, int c)
+{
+    switch (c) {
+      case 4:
+	q[3] = p[3];
+	/* fall through */
+      case 3:
+	q[2] = p[2];
+	q[1] = p[1];
+	/* fall through */
+      default:
+	q[0] = p[0];
+    }
+}
+
+/* inlined with a constant c for each pixel size */
+static inline void
+jp_orient_pixels(const unsigned char *src, unsigned char *dst, long w, long h, int c,
+		 int transpose, int mirror_x, int mirror_y)
+{
+    long x, y, tx, ty;
+
+    if (!transpose) {
+	for (y = 0; y < h; ++y) {
+	    const unsigned char *p = src + y * w * c;
+	    unsigned char *q = dst + (mirror_y ? h - 1 - y : y) * w * c;
+
+	    if (!mirror_x) {
+		memcpy(q, p, w * c);
+		continue;
+	    }
+	    for (x = 0; x < w; ++x) {
+		jp_copy_pixel(q + (w - 1 - x) * c, p + x * c, c);
+	    }
+	}
+	return;
+    }
+
+    /* the destination is h pixels wide; columns of src become its rows */
+    for (ty = 0; ty < h; ty += JP_TILE) {
+	long ey = ty + JP_TILE < h ? ty + JP_TILE : h;
+
+	for (tx = 0; tx < w; tx += JP_TILE) {
+	    long ex = tx + JP_TILE < w ? tx + JP_TILE : w;
+
+	    /* a row of the tile in dst is written sequentially */
+	    for (x = tx; x < ex; ++x) {
+		const unsigned char *p = src + (ty * w + x) * c;
+		long dy = mirror_x ? w - 1 - x : x;
+		unsigned char *q = dst + (dy * h + (mirror_y ? h - 1 - ty : ty)) * c;
+		long step = mirror_y ? -c : c;
+
+		for (y = ty; y < ey; ++y, p += w * c, q += step) {
+		    jp_copy_pixel(q, p, c);
+		}
+	    }
+	}
+    }
+}
+
+/* returns new pixels, and swaps *w and *h if transposed */
+static VALUE
+jp_orient(VALUE raw_data, long *w, long *h, int c, int orientation)
+{
+    const unsigned char *o = jp_orientations[orientation];
+    const unsigned char *src;
+    unsigned char *dst;
+    VALUE dest;
+    long t;
+
+    StringValue(raw_data);
+    if (*w <= 0 || *h <= 0 || RSTRING_LEN(raw_data) < *w * *h * c) {
+	rb_raise(rb_eArgError, "raw_data is smaller than width and height");
+    }
+    src = (const unsigned char *)RSTRING_PTR(raw_data);
+    dest = rb_str_new(NULL, *w * *h * c);
+    dst = (unsigned char *)RSTRING_PTR(dest);
+
+    switch (c) {
+      case 1:
+	jp_orient_pixels(src, dst, *w, *h, 1, o[0], o[1], o[2]);
+	break;
+      case 3:
+	jp_orient_pixels(src, dst, *w, *h, 3, o[0], o[1], o[2]);
+	break;
+      default:
+	jp_orient_pixels(src, dst, *w, *h, 4, o[0], o[1], o[2]);
+	break;
+    }
+    if (o[0]) {
+	t = *w;
+	*w = *h;
+	*h = t;
+    }
+    RB_GC_GUARD(raw_data);
+
+    return dest;
+}
+
+/* sets the decoded pixels of JPEG.read */
+static void
+jp_read_done(VALUE obj, VALUE raw_data, const struct jp_format *fmt, int orientation, int shared)
+{
+    if (orientation > 1) {
+	long w = NUM2LONG(rb_iv_get(obj, "width"));
+	long h = NUM2LONG(rb_iv_get(obj, "height"));
+
+	raw_data = jp_orient(raw_data, &w, &h, fmt->components, orientation);
+	rb_iv_set(obj, "width", LONG2NUM(w));
+	rb_iv_set(obj, "height", LONG2NUM(h));
+    }
+    if (shared) {
+	raw_data = jp_str_share(obj, raw_data);
+    }
+    rb_iv_set(obj, "raw_data", raw_data);
+}
+
+static VALUE
+jp_read_body(VALUE arg)
+{
+    struct jp_read_args *ap = (struct jp_read_args *)arg;
+    j_decompress_ptr dinfo = &ap->dinfo;
+    VALUE src, opts = Qnil;
+    long size;
+    long offset;
+    long len;
+    VALUE obj;
+    VALUE raw_data;
+    VALUE data = Qnil, v;
+    struct mem_src msrc;
+    double pos = 0.0;
+    int threads = 1;
+    int raw = 0;
+    int shared, auto_orient, monitored;
+    int orientation = 1;
+    long limit;
+    const struct jp_format *fmt = NULL, *out;
+    JSAMPROW line = NULL;
+
+    jp_timer_start(&ap->tm);
+    rb_scan_args(ap->argc, ap->argv, "11", &src, &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+    }
+    v = jp_opt(opts, "raw");
+    if (!NIL_P(v) && v != Qfalse) {
+	if (v != ID2SYM(rb_intern("ycbcr"))) {
+	    rb_raise(rb_eArgError, "raw must be :ycbcr");
+	}
+	raw = 1;
+	threads = 1;
+    }
+    v = jp_opt(opts, "format");
+    if (!NIL_P(v)) {
+	fmt = jp_format_of(v);
+    }
+    limit = jp_opt_limit(opts);
+    shared = RTEST(jp_opt(opts, "shared"));
+    auto_orient = RTEST(jp_opt(opts, "auto_orient")) && !raw;
+    v = jp_opt(opts, "threads");
+    if (!NIL_P(v) && !raw) {
+	threads = NUM2INT(v);
+	if (threads < 1) {
+	    rb_raise(rb_eArgError, "threads must be more than 0");
+	}
+    }
+    if (RB_TYPE_P(src, T_STRING)) {
+	/* a snapshot, so that the caller cannot modify it while decoding */
+	data = rb_str_new_frozen(src);
+    }
+    else if (threads > 1 && rb_respond_to(src, rb_intern("read"))) {
+	/* restart markers are indexed over the whole stream */
+	jp_binmode(src);
+	data = rb_funcall(src, rb_intern("read"), 0);
+	StringValue(data);
+    }
+
+    dinfo->err = jpeg_std_error(&ap->jerr);
+    ap->jerr.error_exit = jp_error_exit;
+    jpeg_create_decompress(dinfo);
+    if (NIL_P(data)) {
+	jp_io_src(dinfo, src, opts);
+    }
+    else {
+	jp_mem_src(dinfo, &msrc, (const JOCTET *)RSTRING_PTR(data), RSTRING_LEN(data));
+    }
+    jp_set_max_memory((j_common_ptr)dinfo, opts);
+    /* the progress is checked between the rows of this libjpeg instance */
+    monitored = jp_progress_setup((j_common_ptr)dinfo, &ap->progress, opts);
+    if (auto_orient) {
+	jpeg_save_markers(dinfo, JPEG_APP0 + 1, 0xffff);
+    }
+
+    jpeg_read_header(dinfo, 1);
+    jp_check_limit(dinfo, limit);
+    if (auto_orient) {
+	orientation = jp_exif_orientation(dinfo);
+    }
+    if (raw) {
+	obj = jp_read_planes(dinfo);
+	jpeg_finish_decompress(dinfo);
+	pos = NIL_P(data) ? jp_src_pos(dinfo) : (double)(RSTRING_LEN(data) - dinfo->src->bytes_in_buffer);
+	jp_timer_stop(&ap->tm, JP_OP_READ, (double)dinfo->image_width * dinfo->image_height, pos);
+	return obj;
+    }
+    obj = rb_obj_alloc(cImage);
+    rb_obj_call_init(obj, 0, NULL);
+    rb_iv_set(obj, "width", LONG2NUM(dinfo->image_width));
+    rb_iv_set(obj, "height", LONG2NUM(dinfo->image_height));
+    rb_iv_set(obj, "quality", INT2FIX(100));	/* always 100 */
+    out = jp_setup_decompress(dinfo, fmt);
+    if (!fmt) {
+	fmt = out;
+    }
+    rb_iv_set(obj, "format", jp_format_sym(fmt));
+    /* one thread decodes faster without splitting the stream */
+    if (!NIL_P(data) && !monitored && threads > 1) {
+	ap->tm.workers = 1;
+	raw_data = jp_read_parallel(dinfo, data, threads, fmt);
+	if (!NIL_P(raw_data)) {
+	    jp_read_done(obj, raw_data, fmt, orientation, shared);
+	    jp_timer_stop(&ap->tm, JP_OP_READ, (double)dinfo->image_width * dinfo->image_height, (double)RSTRING_LEN(data));
+	    return obj;
+	}
+    }
+    jpeg_start_decompress(dinfo);
+    size = dinfo->image_width * fmt->components;
+    len = size * dinfo->image_height;
+    raw_data = rb_iv_get(obj, "raw_data");
+    rb_str_resize(raw_data, len);
+    if (out != fmt) {
+	line = (*dinfo->mem->alloc_small)((j_common_ptr)dinfo, JPOOL_IMAGE, dinfo->image_width * out->components);
+    }
+    offset = 0;
+    while (dinfo->output_scanline < dinfo->image_height) {
+	JSAMPROW work = (JSAMPROW)&RSTRING_PTR(raw_data)[offset];
+	jp_read_line(dinfo, out, fmt, work, line);
+	offset += size;
+    }
+
+    jpeg_finish_decompress(dinfo);
+    pos = NIL_P(data) ? jp_src_pos(dinfo) : (double)(RSTRING_LEN(data) - dinfo->src->bytes_in_buffer);
+    RB_GC_GUARD(data);
+    jp_read_done(obj, raw_data, fmt, orientation, shared);
+    jp_timer_stop(&ap->tm, JP_OP_READ, (double)dinfo->image_width * dinfo->image_height, pos);
+
+    return obj;
+}
+
+static VALUE
+jp_read_ensure(VALUE arg)
+{
+    struct jp_read_args *ap = (struct jp_read_args *)arg;
+
+    jp_timer_ensure(&ap->tm, JP_OP_READ);
+    jpeg_destroy_decompress(&ap->dinfo);
+    return Qnil;
+}
+
+static VALUE
+jp_s_read(int argc, VALUE *argv, VALUE klass)
+{
+    struct jp_read_args args;
+
+    args.argc = argc;
+    args.argv = argv;
+    args.dinfo.mem = NULL;	/* nothing to destroy until created */
+    args.tm.on = 0;
+
+    return rb_ensure(jp_read_body, (VALUE)&args, jp_read_ensure, (VALUE)&args);
+}
+
+/* quality: in opts, or the quality of img */
+static int
+jp_opt_quality(VALUE img, VALUE opts)
+{
+    VALUE v = jp_opt(opts, "quality");
+
+    return NUM2INT(NIL_P(v) ? rb_iv_get(img, "quality") : v);
+}
+
+struct jp_wopts {
+    int progressive;
+    int optimize;
+    int restart_rows;
+    int threads;
+};
+
+static void
+jp_write_opts(VALUE opts, struct jp_wopts *wo)
+{
+    VALUE v;
+
+    wo->threads = 1;
+    v = jp_opt(opts, "threads");
+    if (!NIL_P(v)) {
+	wo->threads = NUM2INT(v);
+	if (wo->threads < 1) {
+	    rb_raise(rb_eArgError, "threads must be more than 0");
+	}
+    }
+    /* parallel encoding needs baseline with fixed tables and restart markers */
+    wo->progressive = wo->threads == 1;
+    wo->optimize = wo->threads == 1;
+    wo->restart_rows = wo->threads == 1 ? 0 : 1;
+
+    v = jp_opt(opts, "progressive");
+    if (!NIL_P(v)) {
+	wo->progressive = RTEST(v);
+    }
+    v = jp_opt(opts, "optimize");
+    if (!NIL_P(v)) {
+	wo->optimize = RTEST(v);
+    }
+    v = jp_opt(opts, "restart_rows");
+    if (!NIL_P(v)) {
+	wo->restart_rows = NUM2INT(v);
+	if (wo->restart_rows < 0 || wo->restart_rows > 65535) {
+	    rb_raise(rb_eArgError, "restart_rows must be between 0 to 65535");
+	}
+    }
+    if (wo->threads > 1 &&
+	(wo->progressive || wo->optimize || wo->restart_rows == 0)) {
+	rb_raise(rb_eArgError, "threads cannot be used with progressive, optimize or restart_rows: 0");
+    }
+}
+
+/*
+ * sets up the compression from fmt, and returns the format libjpeg takes.
+ * this never calls Ruby's API, because it is also called in native threads.
+ */
+static const struct jp_format *
+jp_setup_compress(j_compress_ptr cinfo, long width, long height, const struct jp_format *fmt, int quality, const struct jp_wopts *wo)
+{
+    const struct jp_format *in = fmt->space != JCS_UNKNOWN ? fmt : &jp_formats[JP_FMT_RGB];
+
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = in->components;
+    cinfo->in_color_space = in->space;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, 0);
+    if (wo->progressive) {
+	jpeg_simple_progression(cinfo);
+    }
+    cinfo->optimize_coding = wo->optimize;
+    cinfo->restart_in_rows = wo->restart_rows;
+    cinfo->dct_method = JDCT_ISLOW;
+
+    return in;
+}
+
+/* writes one line of fmt, through work if libjpeg takes another format */
+static void
+jp_write_line(j_compress_ptr cinfo, const struct jp_format *in, const struct jp_format *fmt, JSAMPROW row, JSAMPROW work)
+{
+    if (in != fmt) {
+	jp_convert_row(work, in, row, fmt, cinfo->image_width);
+	row = work;
+    }
+    jpeg_write_scanlines(cinfo, &row, 1);
+}
+
+struct strip_out {
+    struct mem_dest dest;
+    size_t len;
+    int failed;
+    char msg[JMSG_LENGTH_MAX];
+};
+
+struct strip_enc {
+    const unsigned char *pixels;
+    long width;
+    long height;
+    const struct jp_format *fmt;
+    int quality;
+    struct jp_wopts wo;
+    long strip_rows;
+    struct strip_out *out;
+};
+
+/* encodes one strip as a standalone JPEG stream */
+static void
+strip_encode(void *arg, long i)
+{
+    struct strip_enc *se = (struct strip_enc *)arg;
+    struct strip_out *so = &se->out[i];
+    struct jpeg_compress_struct cinfo;
+    struct jp_thread_err jerr;
+    long y0 = i * se->strip_rows;
+    long rows = se->height - y0 < se->strip_rows ? se->height - y0 : se->strip_rows;
+    long stride = se->width * se->fmt->components;
+    JSAMPROW work[16];
+    JSAMPARRAY conv = NULL;
+    const struct jp_format *in;
+
+    memset(&cinfo, 0, sizeof(cinfo));
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jp_thread_error_exit;
+    if (setjmp(jerr.jmp)) {
+	(*cinfo.err->format_message)((j_common_ptr)&cinfo, so->msg);
+	so->failed = 1;
+	jpeg_destroy_compress(&cinfo);
+	return;
+    }
+    jpeg_create_compress(&cinfo);
+    jp_mem_dest(&cinfo, &so->dest);
+    in = jp_setup_compress(&cinfo, se->width, rows, se->fmt, se->quality, &se->wo);
+    jpeg_start_compress(&cinfo, 1);
+    if (in != se->fmt) {
+	conv = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, se->width * in->components, 16);
+    }
+    while (cinfo.next_scanline < (JDIMENSION)rows) {
+	int n;
+
+	for (n = 0; n < 16 && cinfo.next_scanline + n < (JDIMENSION)rows; ++n) {
+	    work[n] = (JSAMPROW)(se->pixels + (y0 + cinfo.next_scanline + n) * stride);
+	    if (conv) {
+		jp_convert_row(conv[n], in, work[n], se->fmt, se->width);
+		work[n] = conv[n];
+	    }
+	}
+	jpeg_write_scanlines(&cinfo, work, n);
+    }
+    jpeg_finish_compress(&cinfo);
+    so->len = jp_mem_dest_len(&so->dest);
+    jpeg_destroy_compress(&cinfo);
+}
+
+/*
+ * stitches the strips into one JPEG stream.
+ * the header comes from the first strip with the whole height, and the
+ * restart markers are renumbered through the strips.
+ */
+static VALUE
+strip_stitch(struct strip_out *out, long n, long height)
+{
+    VALUE str;
+    JOCTET *q;
+    long hdr, sof, total, k;
+    int rst = 0;
+
+    hdr = jp_find_scan(out[0].dest.buf, out[0].len, &sof);
+    if (hdr < 0 || sof < 0) {
+	rb_raise(eJpegError, "broken strip");
+    }
+    total = hdr;
+    for (k = 0; k < n; ++k) {
+	total += out[k].len + 2;
+    }
+    str = rb_str_new(NULL, total);
+    q = (JOCTET *)RSTRING_PTR(str);
+    memcpy(q, out[0].dest.buf, hdr);
+    q[sof + 3] = (JOCTET)((height >> 8) & 0xFF);
+    q[sof + 4] = (JOCTET)(height & 0xFF);
+    q += hdr;
+    for (k = 0; k < n; ++k) {
+	long start = jp_find_scan(out[k].dest.buf, out[k].len, &sof);
+	long end = (long)out[k].len - 2;
+
+	if (start < 0 || end < start ||
+	    out[k].dest.buf[end] != 0xFF || out[k].dest.buf[end + 1] != JPEG_EOI) {
+	    rb_raise(eJpegError, "broken strip");
+	}
+	if (k > 0) {
+	    *q++ = 0xFF;
+	    *q++ = (JOCTET)(JPEG_RST0 + (rst & 7));
+	    rst++;
+	}
+	q = jp_copy_scan(q, out[k].dest.buf + start, end - start, &rst);
+    }
+    *q++ = 0xFF;
+    *q++ = JPEG_EOI;
+    rb_str_set_len(str, (char *)q - RSTRING_PTR(str));
+
+    return str;
+}
+
+struct strip_job {
+    struct strip_enc se;
+    long ntasks;
+    VALUE raw_data;
+};
+
+static VALUE
+strip_job_run(VALUE arg)
+{
+    struct strip_job *job = (struct strip_job *)arg;
+    long k;
+
+    jp_parallel(job->se.wo.threads, job->ntasks, strip_encode, &job->se);
+    for (k = 0; k < job->ntasks; ++k) {
+	if (job->se.out[k].failed) {
+	    rb_raise(eJpegError, "%s", job->se.out[k].msg);
+	}
+    }
+
+    return strip_stitch(job->se.out, job->ntasks, job->se.height);
+}
+
+static VALUE
+strip_job_free(VALUE arg)
+{
+    struct strip_job *job = (struct strip_job *)arg;
+    long k;
+
+    for (k = 0; k < job->ntasks; ++k) {
+	free(job->se.out[k].dest.buf);
+    }
+    xfree(job->se.out);
+
+    return Qnil;
+}
+
+/*
+ * encodes horizontal strips of whole restart intervals on native threads.
+ * the result is same as the serial encoding with the same options.
+ * returns nil if the image cannot be split.
+ */
+static VALUE
+jp_write_parallel(VALUE raw_data, long width, long height, const struct jp_format *fmt, int quality, const struct jp_wopts *wo)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct strip_job job;
+    VALUE str;
+    int i, max_h = 1, max_v = 1;
+    long mcu_rows, mcus_per_row, groups, per_strip;
+
+    /* get the MCU size from the default sampling factors */
+    cinfo.err = jpeg_std_error(&jerr);
+    jerr.error_exit = jp_error_exit;
+    jpeg_create_compress(&cinfo);
+    jp_setup_compress(&cinfo, width, height, fmt, quality, wo);
+    for (i = 0; i < cinfo.num_components; ++i) {
+	max_h = max_h > cinfo.comp_info[i].h_samp_factor ? max_h : cinfo.comp_info[i].h_samp_factor;
+	max_v = max_v > cinfo.comp_info[i].v_samp_factor ? max_v : cinfo.comp_info[i].v_samp_factor;
+    }
+    jpeg_destroy_compress(&cinfo);
+
+    mcus_per_row = (width + max_h * DCTSIZE - 1) / (max_h * DCTSIZE);
+    mcu_rows = (height + max_v * DCTSIZE - 1) / (max_v * DCTSIZE);
+    if ((long)wo->restart_rows * mcus_per_row > 65535) {
+	/* libjpeg clamps the interval, then it does not match the rows */
+	return Qnil;
+    }
+    groups = (mcu_rows + wo->restart_rows - 1) / wo->restart_rows;
+    job.ntasks = groups < wo->threads * 2 ? groups : wo->threads * 2;
+    if (job.ntasks < 2) {
+	return Qnil;
+    }
+    per_strip = (groups + job.ntasks - 1) / job.ntasks;
+
+    /* a frozen snapshot, so nobody modifies the pixels while GVL is released */
+    raw_data = rb_str_new_frozen(raw_data);
+    job.se.pixels = (const unsigned char *)RSTRING_PTR(raw_data);
+    job.se.width = width;
+    job.se.height = height;
+    job.se.fmt = fmt;
+    job.se.quality = quality;
+    job.se.wo = *wo;
+    job.se.strip_rows = per_strip * wo->restart_rows * max_v * DCTSIZE;
+    job.ntasks = (height + job.se.strip_rows - 1) / job.se.strip_rows;
+    job.se.out = ALLOC_N(struct strip_out, job.ntasks);
+    memset(job.se.out, 0, sizeof(struct strip_out) * job.ntasks);
+    job.raw_data = raw_data;
+    str = rb_ensure(strip_job_run, (VALUE)&job, strip_job_free, (VALUE)&job);
+    RB_GC_GUARD(raw_data);
+
+    return str;
+}
+
+static VALUE
+jp_write_body(VALUE arg)
+{
+    struct jp_write_args *ap = (struct jp_write_args *)arg;
+    j_compress_ptr cinfo = &ap->cinfo;
+    VALUE obj, dest, opts = Qnil;
+    const struct jp_format *fmt, *in;
+    JSAMPROW line = NULL;
+    long size;
+    long offset;
+    VALUE raw_data;
+    long width, height;
+    int quality;
+    JSAMPROW work;
+    double pos = 0.0;
+    struct jp_wopts wo;
+
+    jp_timer_start(&ap->tm);
+    rb_scan_args(ap->argc, ap->argv, "21", &obj, &dest, &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+    }
+    jp_write_opts(opts, &wo);
+
+    width = NUM2LONG(rb_iv_get(obj, "width"));
+    height = NUM2LONG(rb_iv_get(obj, "height"));
+    quality = jp_opt_quality(obj, opts);
+    if (width <= 0 || height <= 0 || quality <= 0 || quality > 100) {
+	rb_raise(rb_eArgError, "invalid internal paramter");
+    }
+    if (rb_obj_is_kind_of(obj, cPlanes)) {
+	VALUE sampling = rb_iv_get(obj, "sampling");
+	int c, n = jp_check_planes(obj, width, height);
+
+	cinfo->err = jpeg_std_error(&ap->jerr);
+	ap->jerr.error_exit = jp_error_exit;
+	jpeg_create_compress(cinfo);
+	jp_io_dest(cinfo, dest, opts);
+	jp_set_max_memory((j_common_ptr)cinfo, opts);
+	jp_progress_setup((j_common_ptr)cinfo, &ap->progress, opts);
+	jp_setup_compress(cinfo, width, height, &jp_formats[n == 1 ? JP_FMT_GRAY : JP_FMT_RGB], quality, &wo);
+	cinfo->in_color_space = n == 1 ? JCS_GRAYSCALE : JCS_YCbCr;
+	for (c = 0; c < n; ++c) {
+	    cinfo->comp_info[c].h_samp_factor = NUM2INT(RARRAY_AREF(RARRAY_AREF(sampling, c), 0));
+	    cinfo->comp_info[c].v_samp_factor = NUM2INT(RARRAY_AREF(RARRAY_AREF(sampling, c), 1));
+	}
+	jp_write_planes(cinfo, obj);
+	jpeg_finish_compress(cinfo);
+	pos = jp_dest_pos(cinfo);
+	jp_timer_stop(&ap->tm, JP_OP_WRITE, (double)width * height, pos);
+
+	return obj;
+    }
+    fmt = jp_image_format(obj);
+    raw_data = rb_iv_get(obj, "raw_data");
+    if (RSTRING_LEN(raw_data) < width * height * fmt->components) {
+	rb_raise(rb_eArgError, "raw_data is smaller than width and height");
+    }
+
+    /* the progress is checked between the rows of one libjpeg instance */
+    if (wo.threads > 1 && !jp_progress_given(opts)) {
+	VALUE str;
+
+	ap->tm.workers = 1;
+	str = jp_write_parallel(raw_data, width, height, fmt, quality, &wo);
+	if (!NIL_P(str)) {
+	    if (RB_TYPE_P(dest, T_STRING)) {
+		rb_str_buf_append(dest, str);
+	    }
+	    else if (!rb_respond_to(dest, rb_intern("write"))) {
+		rb_raise(rb_eTypeError, "need IO");
+	    }
+	    else {
+		jp_binmode(dest);
+		rb_funcall(dest, rb_intern("write"), 1, str);
+	    }
+	    jp_timer_stop(&ap->tm, JP_OP_WRITE, (double)width * height, (double)RSTRING_LEN(str));
+	    return obj;
+	}
+    }
+
+    cinfo->err = jpeg_std_error(&ap->jerr);
+    ap->jerr.error_exit = jp_error_exit;
+    jpeg_create_compress(cinfo);
+    jp_io_dest(cinfo, dest, opts);
+    jp_set_max_memory((j_common_ptr)cinfo, opts);
+    jp_progress_setup((j_common_ptr)cinfo, &ap->progress, opts);
+    in = jp_setup_compress(cinfo, width, height, fmt, quality, &wo);
+    jpeg_start_compress(cinfo, 1);
+    if (in != fmt) {
+	line = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_IMAGE, width * in->components);
+    }
+
+    size = width * fmt->components;
+    offset = 0;
+    while (cinfo->next_scanline < (unsigned long)height) {
+	work = (JSAMPROW)&RSTRING_PTR(raw_data)[offset];
+	jp_write_line(cinfo, in, fmt, work, line);
+	offset += size;
+    }
+
+    jpeg_finish_compress(cinfo);
+    pos = jp_dest_pos(cinfo);
+    jp_timer_stop(&ap->tm, JP_OP_WRITE, (double)width * height, pos);
+
+    return obj;
+}
+
+static VALUE
+jp_write_ensure(VALUE arg)
+{
+    struct jp_write_args *ap = (struct jp_write_args *)arg;
+
+    jp_timer_ensure(&ap->tm, JP_OP_WRITE);
+    if (ap->cinfo.mem) {
+	jp_str_dest_abort(ap->cinfo.dest);
+    }
+    jpeg_destroy_compress(&ap->cinfo);
+    return Qnil;
+}
+
+static VALUE
+jp_s_write(int argc, VALUE *argv, VALUE klass)
+{
+    struct jp_write_args args;
+
+    args.argc = argc;
+    args.argv = argv;
+    args.cinfo.mem = NULL;	/* nothing to destroy until created */
+    args.tm.on = 0;
+
+    return rb_ensure(jp_write_body, (VALUE)&args, jp_write_ensure, (VALUE)&args);
+}
+
+/*
+ * JPEG.encode with max_bytes: searches the highest quality within the size.
+ * The image is compressed once as baseline at max_quality and its quantized
+ * DCT coefficients are read back, so the color conversion, the downsampling
+ * and the DCT run only once. The size at each quality is estimated from them
+ * by quantizing their nonzero ones again and summing the lengths of the
+ * optimal Huffman codes. Large images are estimated from a sample of the
+ * block rows. Only the qualities the estimate selects are written
+ * by JPEG.write, and the ratio of their real size to the estimate corrects
+ * the next estimate.
+ */
+struct jp_enc_args {
+    VALUE img;
+    VALUE opts;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr cerr;
+    struct jpeg_error_mgr derr;
+    JCOEF *coefs;		/* zigzag index and value of nonzero ones */
+    long ncoefs[MAX_COMPONENTS];
+    double sampling;		/* the blocks per block in coefs */
+    double estimates[101];	/* bytes at each quality, 0 if not yet */
+};
+
+/* the natural order index of each zigzag position */
+static const unsigned char jp_zigzag[DCTSIZE2] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* the coefficients of img compressed at quality, read into dinfo */
+static jvirt_barray_ptr *
+jp_enc_coefficients(struct jp_enc_args *ap, int quality, VALUE *tmp)
+{
+    j_compress_ptr cinfo = &ap->cinfo;
+    j_decompress_ptr dinfo = &ap->dinfo;
+    const struct jp_format *fmt = jp_image_format(ap->img), *in;
+    VALUE raw_data = rb_iv_get(ap->img, "raw_data");
+    long width = NUM2LONG(rb_iv_get(ap->img, "width"));
+    long height = NUM2LONG(rb_iv_get(ap->img, "height"));
+    struct jp_wopts wo = {0, 0, 0, 1};
+    struct mem_src msrc;
+    JSAMPROW line = NULL;
+    long offset, size;
+
+    if (width <= 0 || height <= 0) {
+	rb_raise(rb_eArgError, "invalid internal paramter");
+    }
+    if (RSTRING_LEN(raw_data) < width * height * fmt->components) {
+	rb_raise(rb_eArgError, "raw_data is smaller than width and height");
+    }
+    *tmp = rb_str_buf_new(0);
+    jp_str_dest(cinfo, *tmp);
+    in = jp_setup_compress(cinfo, width, height, fmt, quality, &wo);
+    jpeg_start_compress(cinfo, 1);
+    if (in != fmt) {
+	line = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_IMAGE, width * in->components);
+    }
+    size = width * fmt->components;
+    for (offset = 0; cinfo->next_scanline < (unsigned long)height; offset += size) {
+	jp_write_line(cinfo, in, fmt, (JSAMPROW)&RSTRING_PTR(raw_data)[offset], line);
+    }
+    jpeg_finish_compress(cinfo);
+
+    jp_mem_src(dinfo, &msrc, (const JOCTET *)RSTRING_PTR(*tmp), RSTRING_LEN(*tmp));
+    jpeg_read_header(dinfo, 1);
+
+    return jpeg_read_coefficients(dinfo);
+}
+
+#define JP_ENC_SAMPLE 8192	/* blocks to estimate from */
+
+/*
+ * Collects the coefficients as the DC and the nonzero ACs of each block
+ * followed by DCTSIZE2, each as a pair of its zigzag index and its value.
+ * Every step-th block row is taken.
+ */
+static void
+jp_enc_sparse(struct jp_enc_args *ap, jvirt_barray_ptr *src)
+{
+    j_decompress_ptr dinfo = &ap->dinfo;
+    long n, total = 0, blocks = 0, sampled = 0;
+    int c, k, pass;
+    JDIMENSION y, x, step;
+    JCOEF *p = NULL;
+
+    for (c = 0; c < dinfo->num_components; ++c) {
+	blocks += (long)dinfo->comp_info[c].width_in_blocks * dinfo->comp_info[c].height_in_blocks;
+    }
+    step = (JDIMENSION)(blocks / JP_ENC_SAMPLE) + 1;
+    for (c = 0; c < dinfo->num_components; ++c) {
+	jpeg_component_info *comp = &dinfo->comp_info[c];
+
+	sampled += (long)comp->width_in_blocks * ((comp->height_in_blocks + step - 1) / step);
+    }
+    for (pass = 0; pass < 2; ++pass) {
+	for (c = 0; c < dinfo->num_components; ++c) {
+	    jpeg_component_info *comp = &dinfo->comp_info[c];
+
+	    n = 0;
+	    for (y = 0; y < comp->height_in_blocks; y += step) {
+		JBLOCKARRAY s = (*dinfo->mem->access_virt_barray)((j_common_ptr)dinfo, src[c], y, 1, FALSE);
+
+		for (x = 0; x < comp->width_in_blocks; ++x) {
+		    JCOEFPTR b = s[0][x];
+
+		    n += 2;
+		    if (pass) {
+			*p++ = 0;
+			*p++ = b[0];
+		    }
+		    for (k = 1; k < DCTSIZE2; ++k) {
+			if (b[jp_zigzag[k]] == 0) continue;
+			n += 2;
+			if (pass) {
+			    *p++ = (JCOEF)k;
+			    *p++ = b[jp_zigzag[k]];
+			}
+		    }
+		    n += 2;
+		    if (pass) {
+			*p++ = DCTSIZE2;
+			*p++ = 0;
+		    }
+		}
+	    }
+	    ap->ncoefs[c] = n;
+	    total += n;
+	}
+	if (!pass) {
+	    p = ap->coefs = ALLOC_N(JCOEF, total);
+	}
+    }
+    ap->sampling = (double)blocks / sampled;
+}
+
+/* the bits of the symbols coded by their optimal Huffman code */
+static double
+jp_huff_bits(const long *freq, int n)
+{
+    long f[257];
+    int codesize[257], others[257];
+    int i, c1, c2;
+    double bits = 0;
+
+    for (i = 0; i < n; ++i) {
+	f[i] = freq[i];
+	codesize[i] = 0;
+	others[i] = -1;
+    }
+    f[n] = 1;			/* reserved, as libjpeg does */
+    codesize[n] = 0;
+    others[n] = -1;
+    /* merges the two least frequent trees as jpeg_gen_optimal_table */
+    for (;;) {
+	c1 = c2 = -1;
+	for (i = 0; i <= n; ++i) {
+	    if (f[i] == 0) continue;
+	    if (c1 < 0 || f[i] <= f[c1]) {
+		c2 = c1;
+		c1 = i;
+	    }
+	    else if (c2 < 0 || f[i] <= f[c2]) {
+		c2 = i;
+	    }
+	}
+	if (c2 < 0) break;
+	f[c1] += f[c2];
+	f[c2] = 0;
+	for (codesize[c1]++; others[c1] >= 0; codesize[c1]++) {
+	    c1 = others[c1];
+	}
+	others[c1] = c2;
+	for (codesize[c2]++; others[c2] >= 0; codesize[c2]++) {
+	    c2 = others[c2];
+	}
+    }
+    for (i = 0; i < n; ++i) {
+	bits += (double)freq[i] * codesize[i];
+    }
+
+    return bits;
+}
+
+/* the number of bits of the magnitude of v */
+static int
+jp_nbits(int v)
+{
+    int n = 0;
+
+    if (v < 0) v = -v;
+    for (; v; v >>= 1) ++n;
+
+    return n;
+}
+
+/* the estimated bytes of the coefficients quantized at quality */
+static double
+jp_enc_estimate(struct jp_enc_args *ap, int quality)
+{
+    j_compress_ptr cinfo = &ap->cinfo;
+    j_decompress_ptr dinfo = &ap->dinfo;
+    long dc[2][16], ac[2][256];
+    const JCOEF *p = ap->coefs;
+    long nbits = 0;		/* of the additional bits */
+    double bits;
+    int c, k, t;
+
+    if (ap->estimates[quality] > 0) {
+	return ap->estimates[quality];
+    }
+    memset(dc, 0, sizeof(dc));
+    memset(ac, 0, sizeof(ac));
+    jpeg_set_quality(cinfo, quality, 0);
+    for (c = 0; c < dinfo->num_components; ++c) {
+	jpeg_component_info *comp = &dinfo->comp_info[c];
+	const UINT16 *qs = comp->quant_table->quantval;
+	const UINT16 *qd = cinfo->quant_tbl_ptrs[comp->quant_tbl_no]->quantval;
+	const JCOEF *end = p + ap->ncoefs[c];
+	long scale[DCTSIZE2];	/* in zigzag order, 16 bit fixed point */
+	int pred = 0, last = 0, v, n;
+
+	t = c ? 1 : 0;
+	for (k = 0; k < DCTSIZE2; ++k) {
+	    scale[k] = ((long)qs[jp_zigzag[k]] << 16) / qd[jp_zigzag[k]];
+	}
+	while (p < end) {
+	    v = (int)(((p[1] < 0 ? -p[1] : p[1]) * scale[0] + 0x8000) >> 16);
+	    v = p[1] < 0 ? -v : v;
+	    n = jp_nbits(v - pred);
+	    pred = v;
+	    dc[t][n]++;
+	    nbits += n;
+	    last = 0;
+	    for (p += 2; (k = p[0]) != DCTSIZE2; p += 2) {
+		int run;
+
+		v = (int)(((p[1] < 0 ? -p[1] : p[1]) * scale[k] + 0x8000) >> 16);
+		if (v == 0) continue;
+		for (run = k - last - 1; run > 15; run -= 16) {
+		    ac[t][0xF0]++;
+		}
+		n = jp_nbits(v);
+		ac[t][(run << 4) + n]++;
+		nbits += n;
+		last = k;
+	    }
+	    if (last < DCTSIZE2 - 1) {
+		ac[t][0]++;	/* EOB */
+	    }
+	    p += 2;
+	}
+    }
+    bits = (double)nbits;
+    for (t = 0; t < 2; ++t) {
+	bits += jp_huff_bits(dc[t], 16) + jp_huff_bits(ac[t], 256);
+    }
+
+    return ap->estimates[quality] = bits * ap->sampling / 8;
+}
+
+/* the highest quality in lo..hi estimated within max_bytes, or lo - 1 */
+static int
+jp_enc_search(struct jp_enc_args *ap, int lo, int hi, long max_bytes, double ratio)
+{
+    int q = lo - 1, i;
+
+    /* narrows the range by the estimates already made */
+    for (i = lo; i <= hi; ++i) {
+	if (ap->estimates[i] == 0) continue;
+	if (ap->estimates[i] * ratio <= max_bytes) {
+	    q = i;
+	    lo = i + 1;
+	}
+	else {
+	    hi = i - 1;
+	    break;
+	}
+    }
+
+    while (lo <= hi) {
+	int mid = (lo + hi) / 2;
+
+	if (jp_enc_estimate(ap, mid) * ratio <= max_bytes) {
+	    q = mid;
+	    lo = mid + 1;
+	}
+	else {
+	    hi = mid - 1;
+	}
+    }
+
+    return q;
+}
+
+static VALUE
+jp_encode_body(VALUE arg)
+{
+    struct jp_enc_args *ap = (struct jp_enc_args *)arg;
+    VALUE v, best = Qnil, tmp = Qnil, wargs[3];
+    long max_bytes;
+    int lo = 1, hi, fit, over, q;
+    double ratio = 1.0;
+
+    max_bytes = NUM2LONG(jp_opt(ap->opts, "max_bytes"));
+    hi = jp_opt_quality(ap->img, ap->opts);
+    v = jp_opt(ap->opts, "max_quality");
+    if (!NIL_P(v)) {
+	hi = NUM2INT(v);
+    }
+    v = jp_opt(ap->opts, "min_quality");
+    if (!NIL_P(v)) {
+	lo = NUM2INT(v);
+    }
+    if (max_bytes <= 0) {
+	rb_raise(rb_eArgError, "max_bytes must be more than 0");
+    }
+    if (lo < 1 || hi > 100 || lo > hi) {
+	rb_raise(rb_eArgError, "quality must be 1 <= min_quality <= max_quality <= 100");
+    }
+    if (!rb_obj_is_kind_of(ap->img, cImage)) {
+	rb_raise(rb_eTypeError, "max_bytes needs JPEG::Image");
+    }
+
+    ap->cinfo.err = jpeg_std_error(&ap->cerr);
+    ap->cerr.error_exit = jp_error_exit;
+    jpeg_create_compress(&ap->cinfo);
+    jp_set_max_memory((j_common_ptr)&ap->cinfo, ap->opts);
+    ap->dinfo.err = jpeg_std_error(&ap->derr);
+    ap->derr.error_exit = jp_error_exit;
+    jpeg_create_decompress(&ap->dinfo);
+    jp_set_max_memory((j_common_ptr)&ap->dinfo, ap->opts);
+    jp_enc_sparse(ap, jp_enc_coefficients(ap, hi, &tmp));
+
+    wargs[0] = ap->img;
+    wargs[2] = NIL_P(ap->opts) ? rb_hash_new() : rb_hash_dup(ap->opts);
+    /* fit is within max_bytes and over is not, by their real sizes */
+    fit = lo - 1;
+    over = hi + 1;
+    while (fit + 1 < over) {
+	q = jp_enc_search(ap, fit + 1, over - 1, max_bytes, ratio);
+	if (q <= fit) {
+	    /* the estimates may be wrong by a few bytes, so fit + 1 is tried */
+	    q = fit + 1;
+	}
+	wargs[1] = rb_str_buf_new(0);
+	rb_hash_aset(wargs[2], ID2SYM(rb_intern("quality")), INT2FIX(q));
+	jp_s_write(3, wargs, mJpeg);
+	if (RSTRING_LEN(wargs[1]) <= max_bytes) {
+	    best = wargs[1];
+	    fit = q;
+	}
+	else {
+	    over = q;
+	}
+	ratio = RSTRING_LEN(wargs[1]) / jp_enc_estimate(ap, q);
+    }
+    RB_GC_GUARD(tmp);
+    if (NIL_P(best)) {
+	rb_raise(eJpegLimitError, "cannot be encoded in %ld bytes", max_bytes);
+    }
+
+    return best;
+}
+
+static VALUE
+jp_encode_ensure(VALUE arg)
+{
+    struct jp_enc_args *ap = (struct jp_enc_args *)arg;
+
+    if (ap->cinfo.mem) {
+	jp_str_dest_abort(ap->cinfo.dest);
+    }
+    jpeg_destroy_compress(&ap->cinfo);
+    jpeg_destroy_decompress(&ap->dinfo);
+    xfree(ap->coefs);
+    return Qnil;
+}
+
+static VALUE
+jp_s_encode(int argc, VALUE *argv, VALUE klass)
+{
+    struct jp_enc_args args;
+    VALUE img, opts = Qnil, str;
+
+    rb_scan_args(argc, argv, "11", &img, &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+    }
+    if (NIL_P(jp_opt(opts, "max_bytes"))) {
+	VALUE wargs[3];
+
+	str = rb_str_buf_new(0);
+	wargs[0] = img;
+	wargs[1] = str;
+	wargs[2] = opts;
+	jp_s_write(NIL_P(opts) ? 2 : 3, wargs, klass);
+
+	return str;
+    }
+    memset(args.estimates, 0, sizeof(args.estimates));
+    args.img = img;
+    args.opts = opts;
+    args.cinfo.mem = NULL;	/* nothing to destroy until created */
+    args.dinfo.mem = NULL;
+    args.coefs = NULL;
+
+    return rb_ensure(jp_encode_body, (VALUE)&args, jp_encode_ensure, (VALUE)&args);
+}
+
+/*
+ * Perceptual hashes from the DC coefficients of the luminance.
+ * A DC coefficient is the mean of its 8x8 block. libjpeg decodes 1/8 scale
+ * by the DC coefficients alone (1x1 IDCT), and grayscale output of a YCbCr
+ * file skips the chroma components after the entropy decoding, so this
+ * reads them without IDCT, upsampling, color conversion and a buffer of the
+ * whole image.
+ */
+enum {
+    JP_FP_AHASH,
+    JP_FP_DHASH,
+    JP_FP_PHASH
+};
+
+#define JP_PHASH_SIZE 32
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct jp_fp_args {
+    int argc;
+    VALUE *argv;
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    struct jp_timer tm;
+};
+
+/* area average of a w x h image into dw x dh cells */
+static void
+jp_fp_shrink(const double *src, long w, long h, double *dst, int dw, int dh)
+{
+    int i, j;
+
+    for (j = 0; j < dh; ++j) {
+	long y0 = j * h / dh, y1 = (j + 1) * h / dh;
+
+	if (y1 <= y0) {
+	    y1 = y0 + 1;
+	}
+	for (i = 0; i < dw; ++i) {
+	    long x0 = i * w / dw, x1 = (i + 1) * w / dw, x, y;
+	    double sum = 0;
+
+	    if (x1 <= x0) {
+		x1 = x0 + 1;
+	    }
+	    for (y = y0; y < y1; ++y) {
+		for (x = x0; x < x1; ++x) {
+		    sum += src[y * w + x];
+		}
+	    }
+	    dst[j * dw + i] = sum / ((y1 - y0) * (x1 - x0));
+	}
+    }
+}
+
+static int
+jp_fp_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* bit 63 is the top-left cell */
+static unsigned LONG_LONG
+jp_fp_hash(const double *dc, long w, long h, int kind)
+{
+    double cells[JP_PHASH_SIZE * JP_PHASH_SIZE], low[64], sorted[64], mean = 0;
+    double basis[8][JP_PHASH_SIZE], cols[8][JP_PHASH_SIZE];
+    unsigned LONG_LONG hash = 0;
+    int i, j, u, v;
+
+    switch (kind) {
+      case JP_FP_AHASH:
+	jp_fp_shrink(dc, w, h, cells, 8, 8);
+	for (i = 0; i < 64; ++i) {
+	    mean += cells[i];
+	}
+	mean /= 64;
+	for (i = 0; i < 64; ++i) {
+	    hash = (hash << 1) | (cells[i] > mean);
+	}
+	break;
+
+      case JP_FP_DHASH:
+	jp_fp_shrink(dc, w, h, cells, 9, 8);
+	for (j = 0; j < 8; ++j) {
+	    for (i = 0; i < 8; ++i) {
+		hash = (hash << 1) | (cells[j * 9 + i] < cells[j * 9 + i + 1]);
+	    }
+	}
+	break;
+
+      default:
+	/* the lowest 8x8 frequencies of the DCT of 32x32 cells, separably */
+	jp_fp_shrink(dc, w, h, cells, JP_PHASH_SIZE, JP_PHASH_SIZE);
+	for (u = 0; u < 8; ++u) {
+	    for (i = 0; i < JP_PHASH_SIZE; ++i) {
+		basis[u][i] = cos((2 * i + 1) * u * M_PI / (2 * JP_PHASH_SIZE));
+	    }
+	}
+	for (v = 0; v < 8; ++v) {
+	    for (i = 0; i < JP_PHASH_SIZE; ++i) {
+		double sum = 0;
+
+		for (j = 0; j < JP_PHASH_SIZE; ++j) {
+		    sum += cells[j * JP_PHASH_SIZE + i] * basis[v][j];
+		}
+		cols[v][i] = sum;
+	    }
+	    for (u = 0; u < 8; ++u) {
+		double sum = 0;
+
+		for (i = 0; i < JP_PHASH_SIZE; ++i) {
+		    sum += cols[v][i] * basis[u][i];
+		}
+		low[v * 8 + u] = sum;
+	    }
+	}
+	/* the median without the DC term, which is the mean brightness */
+	memcpy(sorted, low + 1, sizeof(double) * 63);
+	qsort(sorted, 63, sizeof(double), jp_fp_cmp);
+	for (i = 0; i < 64; ++i) {
+	    hash = (hash << 1) | (low[i] > sorted[31]);
+	}
+	break;
+    }
+
+    return hash;
+}
+
+static VALUE
+jp_fingerprint_body(VALUE arg)
+{
+    struct jp_fp_args *ap = (struct jp_fp_args *)arg;
+    j_decompress_ptr dinfo = &ap->dinfo;
+    VALUE src, opts = Qnil, data = Qnil, v, tmp;
+    struct mem_src msrc;
+    JSAMPROW line;
+    double *dc;
+    long w, h, x, y;
+    int kind = JP_FP_PHASH;
+    unsigned LONG_LONG hash;
+
+    jp_timer_start(&ap->tm);
+    rb_scan_args(ap->argc, ap->argv, "11", &src, &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+    }
+    v = jp_opt(opts, "kind");
+    if (!NIL_P(v)) {
+	if (v == ID2SYM(rb_intern("ahash"))) {
+	    kind = JP_FP_AHASH;
+	}
+	else if (v == ID2SYM(rb_intern("dhash"))) {
+	    kind = JP_FP_DHASH;
+	}
+	else if (v != ID2SYM(rb_intern("phash"))) {
+	    rb_raise(rb_eArgError, "kind must be :ahash, :dhash or :phash");
+	}
+    }
+    if (RB_TYPE_P(src, T_STRING)) {
+	data = rb_str_new_frozen(src);
+    }
+
+    dinfo->err = jpeg_std_error(&ap->jerr);
+    ap->jerr.error_exit = jp_error_exit;
+    jpeg_create_decompress(dinfo);
+    if (NIL_P(data)) {
+	jp_io_src(dinfo, src, opts);
+    }
+    else {
+	jp_mem_src(dinfo, &msrc, (const JOCTET *)RSTRING_PTR(data), RSTRING_LEN(data));
+    }
+    jp_set_max_memory((j_common_ptr)dinfo, opts);
+    jpeg_read_header(dinfo, 1);
+    jp_check_limit(dinfo, jp_opt_limit(opts));
+
+    dinfo->scale_num = 1;
+    dinfo->scale_denom = 8;
+    if (dinfo->jpeg_color_space == JCS_YCbCr) {
+	dinfo->out_color_space = JCS_GRAYSCALE;
+    }
+    dinfo->do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(dinfo);
+    w = dinfo->output_width;
+    h = dinfo->output_height;
+    /* the DC terms, and a row of the output after them */
+    tmp = rb_str_new(NULL, sizeof(double) * w * h + w * dinfo->output_components);
+    dc = (double *)RSTRING_PTR(tmp);
+    line = (JSAMPROW)(dc + w * h);
+    for (y = 0; y < h; ++y) {
+	jpeg_read_scanlines(dinfo, &line, 1);
+	for (x = 0; x < w; ++x) {
+	    /* the first component otherwise, such as R of RGB files */
+	    dc[y * w + x] = line[x * dinfo->output_components];
+	}
+    }
+    hash = jp_fp_hash(dc, w, h, kind);
+    jpeg_finish_decompress(dinfo);
+    RB_GC_GUARD(tmp);
+    RB_GC_GUARD(data);
+    jp_timer_stop(&ap->tm, JP_OP_FINGERPRINT, (double)dinfo->image_width * dinfo->image_height, 0);
+
+    return ULL2NUM(hash);
+}
+
+static VALUE
+jp_fingerprint_ensure(VALUE arg)
+{
+    struct jp_fp_args *ap = (struct jp_fp_args *)arg;
+
+    jp_timer_ensure(&ap->tm, JP_OP_FINGERPRINT);
+    jpeg_destroy_decompress(&ap->dinfo);
+    return Qnil;
+}
+
+static VALUE
+jp_s_fingerprint(int argc, VALUE *argv, VALUE klass)
+{
+    struct jp_fp_args args;
+
+    args.argc = argc;
+    args.argv = argv;
+    args.dinfo.mem = NULL;	/* nothing to destroy until created */
+    args.tm.on = 0;
+
+    return rb_ensure(jp_fingerprint_body, (VALUE)&args, jp_fingerprint_ensure, (VALUE)&args);
+}
+
+static void
+get_point_bilinear(unsigned char *ptr, long width, long height, int components, double x, double y, int *out)
+{
+    long x1, y1;
+    double dx, dy;
+    unsigned char c[4][4];
+    int i;
+
+    x1 = (long)x;
+    y1 = (long)y;
+    dx = x - x1;
+    dy = y - y1;
+
+    for (i = 0; i < components; ++i) {
+	c[0][i] = ptr[((x1 + 0) + (y1 + 0) * width) * components + i];
+	c[1][i] = ptr[((x1 + 1) + (y1 + 0) * width) * components + i];
+	c[2][i] = ptr[((x1 + 0) + (y1 + 1) * width) * components + i];
+	c[3][i] = ptr[((x1 + 1) + (y1 + 1) * width) * components + i];
+    }
+
+    for (i = 0; i < components; ++i) {
+	out[i] = (int)(dx * dy * (c[0][i] - c[1][i] - c[2][i] + c[3][i]) + dx * (c[1][i] - c[0][i]) + dy * (c[2][i] - c[0][i]) + c[0][i]);
+    }
+}
+
+static inline double
+bicubic_weight(double d)
+{
+    double d2 = d * d;
+    double d3 = d2 * d;
+    return d < 1.0 ? (1.0 - 2.0 * d2 + d3) : d < 2.0 ? (4.0 - 8.0 * d + 5.0 * d2 - d3) : 0.0;
+}
+
+static inline int
+saturate(int n, int min, int max)
+{
+    return n < min ? min : n > max ? max : n;
+}
+
+static void
+get_point_bicubic(unsigned char *ptr, long width, long height, int components, double dx, double dy, int *out)
+{
+    long x[4], y[4];
+    long wx[4], wy[4], wt;
+    long sum[4];
+    int i, j, k;
+
+    x[1] = (long)dx;
+    x[0] = x[1] - 1;
+    x[2] = x[1] + 1;
+    x[3] = x[2] + 1;
+
+    y[1] = (long)dy;
+    y[0] = y[1] - 1;
+    y[2] = y[1] + 1;
+    y[3] = y[2] + 1;
+
+    wx[0] = (long)(bicubic_weight(dx - x[0]) * 1024);
+    wx[1] = (long)(bicubic_weight(dx - x[1]) * 1024);
+    wx[2] = (long)(bicubic_weight(x[2] - dx) * 1024);
+    wx[3] = (long)(bicubic_weight(x[3] - dx) * 1024);
+    wy[0] = (long)(bicubic_weight(dy - y[0]) * 1024);
+    wy[1] = (long)(bicubic_weight(dy - y[1]) * 1024);
+    wy[2] = (long)(bicubic_weight(y[2] - dy) * 1024);
+    wy[3] = (long)(bicubic_weight(y[3] - dy) * 1024);
+
+    sum[0] = sum[1] = sum[2] = sum[3] = 0;
+    wt = 0;
+    for (j = 0; j < 4; ++j) {
+	if (y[j] >= 0 && y[j] < height) {
+	    for (i = 0; i < 4; ++i) {
+		if (x[i] >= 0 && x[i] < width) {
+		    long w = wx[i] * wy[j];
+		    long pos = (x[i] + y[j] * width) * components;
+		    for (k = 0; k < components; ++k) {
+			sum[k] += ptr[pos + k] * w;
+		    }
+		    wt += w;
+		}
+	    }
+	}
+    }
+
+    for (k = 0; k < components; ++k) {
+	out[k] = saturate((int)(sum[k] / wt), 0, 255);
+    }
+}
+
+/*
+ * Unsharp mask on a stream of rows.
+ * The blur is a separable gaussian with integer weights. Each pushed row is
+ * blurred horizontally into a ring of 2 * half + 1 rows, and a row is
+ * emitted when the rows below it within the radius have been pushed, so it
+ * is sharpened while its neighbours are still in the cache.
+ */
+#define USM_MAX_HALF 64
+#define USM_WBITS 10
+
+struct usm {
+    int amount;			/* 8 bits fixed point */
+    int threshold;
+    int half;
+    int weights[USM_MAX_HALF + 1];
+    long width;
+    long height;
+    int components;
+    int extra;
+    long stride;
+    unsigned char *rows;	/* ring of source rows */
+    int *hrows;			/* ring of horizontally blurred rows */
+};
+
+static void
+usm_params(VALUE v, double *amount, double *radius, int *threshold)
+{
+    VALUE a;
+
+    *amount = 0.5;
+    *radius = 1.0;
+    *threshold = 0;
+    if (RB_TYPE_P(v, T_HASH)) {
+	if (!NIL_P(a = jp_opt(v, "amount"))) *amount = NUM2DBL(a);
+	if (!NIL_P(a = jp_opt(v, "radius"))) *radius = NUM2DBL(a);
+	if (!NIL_P(a = jp_opt(v, "threshold"))) *threshold = NUM2INT(a);
+    }
+    else if (v != Qtrue) {
+	rb_raise(rb_eTypeError, "sharpen must be true or a Hash");
+    }
+}
+
+/* buf holds the rings; its size is returned by usm_init with buf NULL */
+static long
+usm_init(struct usm *u, char *buf, double amount, double radius, int threshold,
+	 long width, long height, const struct jp_format *fmt)
+{
+    int i, sum;
+    double sigma = radius, total;
+
+    if (amount < 0 || amount > 16) {
+	rb_raise(rb_eArgError, "amount must be between 0 and 16");
+    }
+    if (radius <= 0 || radius > USM_MAX_HALF / 2) {
+	rb_raise(rb_eArgError, "radius must be more than 0 and up to %d", USM_MAX_HALF / 2);
+    }
+    if (threshold < 0 || threshold > 255) {
+	rb_raise(rb_eArgError, "threshold must be between 0 and 255");
+    }
+    u->amount = (int)(amount * 256 + 0.5);
+    u->threshold = threshold;
+    u->half = (int)ceil(radius * 2);
+    u->width = width;
+    u->height = height;
+    u->components = fmt->components;
+    u->extra = fmt->extra;
+    u->stride = width * fmt->components;
+
+    total = 0;
+    for (i = 0; i <= u->half; ++i) {
+	total += (i ? 2 : 1) * exp(-(double)i * i / (2 * sigma * sigma));
+    }
+    sum = 0;
+    for (i = 1; i <= u->half; ++i) {
+	u->weights[i] = (int)(exp(-(double)i * i / (2 * sigma * sigma)) / total * (1 << USM_WBITS) + 0.5);
+	sum += 2 * u->weights[i];
+    }
+    /* the weights sum to exactly 1 << USM_WBITS */
+    u->weights[0] = (1 << USM_WBITS) - sum;
+
+    if (buf) {
+	u->hrows = (int *)buf;
+	u->rows = (unsigned char *)(u->hrows + u->stride * (2 * u->half + 1));
+    }
+
+    return (long)(2 * u->half + 1) * u->stride * (sizeof(int) + 1);
+}
+
+static void
+usm_push(struct usm *u, long y, const unsigned char *row)
+{
+    long slot = (y % (2 * u->half + 1)) * u->stride;
+    unsigned char *p = u->rows + slot;
+    int *h = u->hrows + slot;
+    long n = u->stride, edge, j;
+    int c = u->components, i;
+
+    memcpy(p, row, n);
+    for (j = 0; j < n; ++j) {
+	h[j] = p[j] * u->weights[0];
+    }
+    for (i = 1; i <= u->half; ++i) {
+	int w = u->weights[i];
+	long off = (long)i * c;
+
+	/* interior without clamping, so that the loop can be vectorized */
+	for (j = off; j < n - off; ++j) {
+	    h[j] += (p[j - off] + p[j + off]) * w;
+	}
+	edge = off < n ? off : n;
+	for (j = 0; j < edge; ++j) {
+	    long l = j % c, r = j + off < n ? j + off : n - c + j % c;
+	    h[j] += (p[l] + p[r]) * w;
+	}
+	for (j = n - off > edge ? n - off : edge; j < n; ++j) {
+	    long l = j - off >= 0 ? j - off : j % c;
+	    h[j] += (p[l] + p[n - c + j % c]) * w;
+	}
+    }
+}
+
+static void
+usm_emit(struct usm *u, long y, unsigned char *out)
+{
+    long ring = 2 * u->half + 1;
+    long n = u->stride, j;
+    const unsigned char *p = u->rows + (y % ring) * n;
+    int *h[2 * USM_MAX_HALF + 1];
+    int c = u->components, i;
+
+    for (i = -u->half; i <= u->half; ++i) {
+	long yy = y + i < 0 ? 0 : y + i >= u->height ? u->height - 1 : y + i;
+	h[i + u->half] = u->hrows + (yy % ring) * n;
+    }
+    for (j = 0; j < n; ++j) {
+	int sum = h[u->half][j] * u->weights[0];
+	int blur, diff;
+
+	for (i = 1; i <= u->half; ++i) {
+	    sum += (h[u->half - i][j] + h[u->half + i][j]) * u->weights[i];
+	}
+	blur = (sum + (1 << (2 * USM_WBITS - 1))) >> (2 * USM_WBITS);
+	diff = p[j] - blur;
+	if ((diff < 0 ? -diff : diff) < u->threshold || j % c == u->extra) {
+	    out[j] = p[j];
+	}
+	else {
+	    out[j] = saturate(p[j] + ((diff * u->amount) >> 8), 0, 255);
+	}
+    }
+}
+
+/* emits the rows which have all their neighbours after row y is pushed */
+static void
+usm_flush(struct usm *u, long y, unsigned char *dest)
+{
+    long e;
+
+    if (y == u->height - 1) {
+	for (e = y - u->half < 0 ? 0 : y - u->half; e < u->height; ++e) {
+	    usm_emit(u, e, dest + e * u->stride);
+	}
+    }
+    else if (y >= u->half) {
+	usm_emit(u, y - u->half, dest + (y - u->half) * u->stride);
+    }
+}
+
+typedef void (* get_point_t)(unsigned char *, long, long, int, double, double, int *);
+
+static VALUE
+im_resize(int op, get_point_t get_point, int argc, VALUE *argv, VALUE self)
+{
+    long width, height;
+    long dw, dh;
+    double bx;
+    double by;
+    long x1, y1;
+    double x2, y2;
+    VALUE dwidth, dheight, opts = Qnil, sharpen;
+    VALUE src;
+    VALUE dest;
+    VALUE tmp = Qnil;
+    VALUE jpeg;
+    const struct jp_format *fmt;
+    int components;
+    unsigned char *row = NULL;
+    struct usm u;
+    struct jp_timer tm;
+
+    jp_timer_start(&tm);
+    rb_scan_args(argc, argv, "21", &dwidth, &dheight, &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+    }
+    dw = NUM2LONG(dwidth);
+    dh = NUM2LONG(dheight);
+    width = NUM2LONG(rb_iv_get(self, "width"));
+    height = NUM2LONG(rb_iv_get(self, "height"));
+    src = rb_iv_get(self, "raw_data");
+    fmt = jp_image_format(self);
+    components = fmt->components;
+    dest = rb_str_new(NULL, 0);
+    rb_str_resize(dest, dw * dh * components);
+    sharpen = jp_opt(opts, "sharpen");
+    if (RTEST(sharpen)) {
+	double amount, radius;
+	int threshold;
+
+	usm_params(sharpen, &amount, &radius, &threshold);
+	tmp = rb_str_new(NULL, usm_init(&u, NULL, amount, radius, threshold, dw, dh, fmt) + dw * components);
+	usm_init(&u, RSTRING_PTR(tmp), amount, radius, threshold, dw, dh, fmt);
+	row = (unsigned char *)RSTRING_PTR(tmp) + RSTRING_LEN(tmp) - dw * components;
+    }
+    bx = (double)width / dw;
+    by = (double)height / dh;
+    for (y1 = 0, y2 = 0.0; y1 < dh; y1++) {
+	if (NIL_P(tmp)) {
+	    row = (unsigned char *)RSTRING_PTR(dest) + y1 * dw * components;
+	}
+	for (x1 = 0, x2 = 0.0; x1 < dw; x1++) {
+	    int c[4], i;
+	    get_point((unsigned char *)RSTRING_PTR(src), width, height, components, x2, y2, c);
+	    for (i = 0; i < components; ++i) {
+		row[x1 * components + i] = c[i];
+	    }
+	    x2 += bx;
+	}
+	if (!NIL_P(tmp)) {
+	    usm_push(&u, y1, row);
+	    usm_flush(&u, y1, (unsigned char *)RSTRING_PTR(dest));
+	}
+	y2 += by;
+    }
+    RB_GC_GUARD(tmp);
+
+    jpeg = rb_class_new_instance(0, 0, cImage);
+    rb_iv_set(jpeg, "raw_data", dest);
+    rb_iv_set(jpeg, "width", LONG2NUM(dw));
+    rb_iv_set(jpeg, "height", LONG2NUM(dh));
+    rb_iv_set(jpeg, "quality", INT2FIX(100));
+    rb_iv_set(jpeg, "format", rb_iv_get(self, "format"));
+    jp_timer_stop(&tm, op, (double)dw * dh, 0);
+
+    return jpeg;
+}
+
+static VALUE
+im_bilinear(int argc, VALUE *argv, VALUE self)
+{
+    return im_resize(JP_OP_BILINEAR, get_point_bilinear, argc, argv, self);
+}
+
+static VALUE
+im_bicubic(int argc, VALUE *argv, VALUE self)
+{
+    return im_resize(JP_OP_BICUBIC, get_point_bicubic, argc, argv, self);
+}
+
+static VALUE
+im_unsharp(int argc, VALUE *argv, VALUE self)
+{
+    VALUE a, r, t;
+    VALUE jpeg;
+    long width, height, y;
+    VALUE src, dest, tmp;
+    const struct jp_format *fmt;
+    double amount, radius;
+    int threshold;
+    struct usm u;
+    struct jp_timer tm;
+
+    jp_timer_start(&tm);
+    rb_scan_args(argc, argv, "03", &a, &r, &t);
+    amount = NIL_P(a) ? 0.5 : NUM2DBL(a);
+    radius = NIL_P(r) ? 1.0 : NUM2DBL(r);
+    threshold = NIL_P(t) ? 0 : NUM2INT(t);
+
+    width = NUM2LONG(rb_iv_get(self, "width"));
+    height = NUM2LONG(rb_iv_get(self, "height"));
+    src = rb_iv_get(self, "raw_data");
+    fmt = jp_image_format(self);
+    dest = rb_str_new(NULL, 0);
+    rb_str_resize(dest, width * height * fmt->components);
+    tmp = rb_str_new(NULL, usm_init(&u, NULL, amount, radius, threshold, width, height, fmt));
+    usm_init(&u, RSTRING_PTR(tmp), amount, radius, threshold, width, height, fmt);
+    for (y = 0; y < height; ++y) {
+	usm_push(&u, y, (unsigned char *)RSTRING_PTR(src) + y * u.stride);
+	usm_flush(&u, y, (unsigned char *)RSTRING_PTR(dest));
+    }
+    RB_GC_GUARD(tmp);
+
+    jpeg = rb_class_new_instance(0, 0, cImage);
+    rb_iv_set(jpeg, "raw_data", dest);
+    rb_iv_set(jpeg, "width", LONG2NUM(width));
+    rb_iv_set(jpeg, "height", LONG2NUM(height));
+    rb_iv_set(jpeg, "quality", INT2FIX(100));
+    rb_iv_set(jpeg, "format", rb_iv_get(self, "format"));
+    jp_timer_stop(&tm, JP_OP_UNSHARP, (double)width * height, 0);
+
+    return jpeg;
+}
+
+static VALUE
+im_orient(int op, int orientation, VALUE self)
+{
+    VALUE jpeg;
+    long width, height;
+    VALUE dest;
+    struct jp_timer tm;
+
+    jp_timer_start(&tm);
+    width = NUM2LONG(rb_iv_get(self, "width"));
+    height = NUM2LONG(rb_iv_get(self, "height"));
+    dest = jp_orient(rb_iv_get(self, "raw_data"), &width, &height,
+		     jp_image_format(self)->components, orientation);
+
+    jpeg = rb_class_new_instance(0, 0, cImage);
+    rb_iv_set(jpeg, "raw_data", dest);
+    rb_iv_set(jpeg, "width", LONG2NUM(width));
+    rb_iv_set(jpeg, "height", LONG2NUM(height));
+    rb_iv_set(jpeg, "quality", INT2FIX(100));
+    rb_iv_set(jpeg, "format", rb_iv_get(self, "format"));
+    jp_timer_stop(&tm, op, (double)width * height, 0);
+
+    return jpeg;
+}
+
+static VALUE
+im_rotate(VALUE self, VALUE degree)
+{
+    switch (NUM2INT(degree)) {
+      case 90:
+	return im_orient(JP_OP_ROTATE, JP_ORIENT_ROTATE_90, self);
+      case 180:
+	return im_orient(JP_OP_ROTATE, JP_ORIENT_ROTATE_180, self);
+      case 270:
+	return im_orient(JP_OP_ROTATE, JP_ORIENT_ROTATE_270, self);
+      default:
+	rb_raise(rb_eArgError, "degree must be 90, 180 or 270");
+    }
+
+    return Qnil;		/* not reached */
+}
+
+static VALUE
+im_flip(VALUE self)
+{
+    return im_orient(JP_OP_FLIP, JP_ORIENT_FLIP, self);
+}
+
+static VALUE
+im_flop(VALUE self)
+{
+    return im_orient(JP_OP_FLOP, JP_ORIENT_FLOP, self);
+}
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+static VALUE
+im_contrast(VALUE self)
+{
+    VALUE jpeg;
+    long width;
+    long height;
+    VALUE src;
+    VALUE dest;
+    long x, y;
+    unsigned char min, max, median;
+    const struct jp_format *fmt;
+    int components;
+    int low, high;
+    int i;
+    long sum, half, hist[256];
+    struct jp_timer tm;
+
+    jp_timer_start(&tm);
+    width = NUM2LONG(rb_iv_get(self, "width"));
+    height = NUM2LONG(rb_iv_get(self, "height"));
+    src = rb_iv_get(self, "raw_data");
+    fmt = jp_image_format(self);
+    components = fmt->components;
+    dest = rb_str_new(NULL, 0);
+    rb_str_resize(dest, width * height * components);
+
+    memset(hist, 0, sizeof(hist));
+    min = 255; max = 0;
+    for (y = 0; y < height; ++y) {
+	for (x = 0; x < width; ++x) {
+	    unsigned char *p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * components];
+	    unsigned char gray = components > 1 ? grayscale(p[fmt->r], p[fmt->g], p[fmt->b]) : *p;
+	    min = min(gray, min);
+	    max = max(gray, max);
+	    hist[gray]++;
+	}
+    }
+
+    half = width * height / 2;
+    median = 128;
+    sum = 0;
+    for (i = 0; i < (long)sizeof(hist); ++i) {
+	sum += hist[i];
+	if (sum >= half) {
+	    median = i;
+	    break;
+	}
+    }
+
+    low = median - min;
+    high = max - median;
+    if (low && high) {
+	for (y = 0; y < height; ++y) {
+	    for (x = 0; x < width; ++x) {
+		unsigned char *p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * components];
+		unsigned char *q = (unsigned char *)&RSTRING_PTR(dest)[(x + y * width) * components];
+		int i;
+		for (i = 0; i < components; ++i) {
+		    /* alpha or padding is kept */
+		    q[i] = i == fmt->extra ? p[i] : p[i] < median ? (p[i] - min) * 127 / low : (p[i] - median) * 127 / high + 128;
+		}
+	    }
+	}
+    }
+    else {
+	memcpy(RSTRING_PTR(dest), RSTRING_PTR(src), width * height * components);
+    }
+
+    jpeg = rb_class_new_instance(0, 0, cImage);
+    rb_iv_set(jpeg, "raw_data", dest);
+    rb_iv_set(jpeg, "width", LONG2NUM(width));
+    rb_iv_set(jpeg, "height", LONG2NUM(height));
+    rb_iv_set(jpeg, "quality", INT2FIX(100));
+    rb_iv_set(jpeg, "format", rb_iv_get(self, "format"));
+    jp_timer_stop(&tm, JP_OP_CONTRAST, (double)width * height, 0);
+
+    return jpeg;
+}
+
+static VALUE
+im_grayscale(VALUE self)
+{
+    VALUE jpeg;
+    long width;
+    long height;
+    VALUE src;
+    VALUE dest;
+    long x, y;
+    const struct jp_format *fmt;
+    struct jp_timer tm;
+
+    jp_timer_start(&tm);
+    width = NUM2LONG(rb_iv_get(self, "width"));
+    height = NUM2LONG(rb_iv_get(self, "height"));
+    src = rb_iv_get(self, "raw_data");
+    fmt = jp_image_format(self);
+    dest = rb_str_new(NULL, 0);
+    rb_str_resize(dest, width * height);
+    if (fmt->components == 1) {
+	memcpy(RSTRING_PTR(dest), RSTRING_PTR(src), width * height);
+    }
+    else {
+	unsigned char *q = (unsigned char *)RSTRING_PTR(dest);
+	for (y = 0; y < height; ++y) {
+	    for (x = 0; x < width; ++x, ++q) {
+		unsigned char *p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * fmt->components];
+		*q = grayscale(p[fmt->r], p[fmt->g], p[fmt->b]);
+	    }
+	}
+    }
+
+    jpeg = rb_class_new_instance(0, 0, cImage);
+    rb_iv_set(jpeg, "raw_data", dest);
+    rb_iv_set(jpeg, "width", LONG2NUM(width));
+    rb_iv_set(jpeg, "height", LONG2NUM(height));
+    rb_iv_set(jpeg, "quality", INT2FIX(100));
+    rb_iv_set(jpeg, "format", jp_format_sym(&jp_formats[JP_FMT_GRAY]));
+    jp_timer_stop(&tm, JP_OP_GRAYSCALE, (double)width * height, 0);
+
+    return jpeg;
+}
+
+static VALUE
+im_level(int argc, VALUE *argv, VALUE self)
+{
+    VALUE l, h, adj = Qfalse;
+    int low, high, d;
+    VALUE jpeg;
+    long width, height;
+    VALUE src, dest;
+    long x, y;
+    const struct jp_format *fmt;
+    int components;
+    struct jp_timer tm;
+
+    jp_timer_start(&tm);
+    rb_scan_args(argc, argv, "21", &l, &h, &adj);
+    low = NUM2LONG(l);
+    high = NUM2LONG(h);
+    if (low < 0 || low > 100 || high < 0 || high > 100) {
+	rb_raise(rb_eArgError, "level must be between 1 to 100");
+    }
+    if (low >= high) {
+	rb_raise(rb_eArgError, "low must be less than high");
+    }
+    low = low * 256 / 100;
+    high = high * 256 / 100;
+    d = high - low;
+
+    width = NUM2LONG(rb_iv_get(self, "width"));
+    height = NUM2LONG(rb_iv_get(self, "height"));
+    src = rb_iv_get(self, "raw_data");
+    fmt = jp_image_format(self);
+    components = fmt->components;
+    dest = rb_str_new(NULL, 0);
+    rb_str_resize(dest, width * height * components);
+
+    for (y = 0; y < height; ++y) {
+	for (x = 0; x < width; ++x) {
+	    unsigned char *p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * components];
+	    unsigned char *q = (unsigned char *)&RSTRING_PTR(dest)[(x + y * width) * components];
+	    int i;
+	    for (i = 0; i < components; ++i) {
+		q[i] = i == fmt->extra ? p[i] : p[i] < low ? 0 : p[i] >= high ? 255 : RTEST(adj) ? (p[i] - low) * d / 256 : p[i];
+	    }
+	}
+    }
+
+    jpeg = rb_class_new_instance(0, 0, cImage);
+    rb_iv_set(jpeg, "raw_data", dest);
+    rb_iv_set(jpeg, "width", LONG2NUM(width));
+    rb_iv_set(jpeg, "height", LONG2NUM(height));
+    rb_iv_set(jpeg, "quality", INT2FIX(100));
+    rb_iv_set(jpeg, "format", rb_iv_get(self, "format"));
+    jp_timer_stop(&tm, JP_OP_LEVEL, (double)width * height, 0);
+
+    return jpeg;
+}
+
+static VALUE
+im_clip(int argc, VALUE *argv, VALUE self)
+{
+    long x1, y1, x2, y2;
+    long width, height;
+    long dwidth, dheight;
+    long x, y;
+    long i;
+    int components;
+    VALUE src, dest;
+    VALUE jpeg;
+    struct jp_timer tm;
+
+    jp_timer_start(&tm);
+    if (argc != 0 && argc != 4) {
+	rb_raise(rb_eArgError,
+		 "wrong number of arguments(%d for 0 or 4)", argc);
+    }
+
+    src = rb_iv_get(self, "raw_data");
+    components = jp_image_format(self)->components;
+
+    width = NUM2LONG(rb_iv_get(self, "width"));
+    height = NUM2LONG(rb_iv_get(self, "height"));
+
+    if (argc == 0) {
+	unsigned char base[4], *p;
+
+	memcpy(base, RSTRING_PTR(src), components);
+
+	x1 = width - 1;
+	y1 = height - 1;
+	for (y = 0; y < height; ++y) {
+	    for (x = 0; x <= x1; ++x) {
+		p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * components];
+		for (i = 0; i < components; ++i) {
+		    if (p[i] != base[i]) {
+			x1 = x;
+			if (y < y1) y1 = y;
+			break;
+		    }
+		}
+	    }
+	}
+
+	x2 = x1;
+	y2 = y1;
+	for (y = height - 1; y >= 0; --y) {
+	    for (x = width - 1; x >= x2; --x) {
+		p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * components];
+		for (i = 0; i < components; ++i) {
+		    if (p[i] != base[i]) {
+			x2 = x;
+			if (y > y2) y2 = y;
+			break;
+		    }
+		}
+	    }
+	}
+
+	if (x1 == x2 || y1 == y2) {
+	    return Qnil;
+	}
+    }
+    else {
+	x1 = NUM2LONG(argv[0]);
+	y1 = NUM2LONG(argv[1]);
+	x2 = NUM2LONG(argv[2]);
+	y2 = NUM2LONG(argv[3]);
+	if (x1 >= x2 || y1 >= y2) {
+	    rb_raise(rb_eArgError, "wrong combination of arguments");
+	}
+    }
+
+    dwidth = x2 - x1 + 1;
+    dheight = y2 - y1 + 1;
+    dest = rb_str_new(NULL, 0);
+    rb_str_resize(dest, dwidth * dheight * components);
+    memset(RSTRING_PTR(dest), 0xFF, dwidth * dheight * components);
+
+    for (y = y1; y <= y2 && y < height; ++y) {
+	unsigned char *p = (unsigned char *)&RSTRING_PTR(src)[(x1 + y * width) * components];
+	unsigned char *q = (unsigned char *)&RSTRING_PTR(dest)[(y - y1) * dwidth * components];
+	memcpy(q, p, dwidth * components);
+    }
+
+    RB_GC_GUARD(dest);	/* need? */
+
+    jpeg = rb_class_new_instance(0, 0, cImage);
+    rb_iv_set(jpeg, "raw_data", dest);
+    rb_iv_set(jpeg, "width", LONG2NUM(dwidth));
+    rb_iv_set(jpeg, "height", LONG2NUM(dheight));
+    rb_iv_set(jpeg, "quality", INT2FIX(100));
+    rb_iv_set(jpeg, "format", rb_iv_get(self, "format"));
+    jp_timer_stop(&tm, JP_OP_CLIP, (double)dwidth * dheight, 0);
+
+    return rb_ary_new3(5, jpeg, LONG2NUM(x1), LONG2NUM(y1), LONG2NUM(x2), LONG2NUM(y2));
+}
+
+static VALUE
+im_gray_p(VALUE self)
+{
+    return jp_image_format(self)->components == 1 ? Qtrue : Qfalse;
+}
+
+static VALUE
+im_get_format(VALUE self)
+{
+    return rb_iv_get(self, "format");
+}
+
+static VALUE
+im_set_format(VALUE self, VALUE v)
+{
+    rb_iv_set(self, "format", jp_format_sym(jp_format_of(v)));
+    return self;
+}
+
+static VALUE
+im_dump(VALUE self, VALUE path)
+{
+    const struct jp_format *fmt = jp_image_format(self);
+    long width = NUM2LONG(rb_iv_get(self, "width"));
+    long height = NUM2LONG(rb_iv_get(self, "height"));
+    VALUE raw_data = rb_iv_get(self, "raw_data");
+    unsigned char header[JP_DUMP_HEADER];
+    long len = width * height * fmt->components;
+    FILE *fp;
+
+    FilePathValue(path);
+    if (width <= 0 || height <= 0 || RSTRING_LEN(raw_data) < len) {
+	rb_raise(rb_eArgError, "raw_data is smaller than width and height");
+    }
+    memset(header, 0, sizeof(header));
+    memcpy(header, JP_DUMP_MAGIC, 8);
+    jp_put_le(header + 8, width, 4);
+    jp_put_le(header + 12, height, 4);
+    jp_put_le(header + 16, FIX2INT(rb_iv_get(self, "quality")), 4);
+    jp_put_le(header + 20, fmt - jp_formats, 4);
+
+    fp = fopen(RSTRING_PTR(path), "wb");
+    if (!fp) {
+	rb_sys_fail(RSTRING_PTR(path));
+    }
+    if (fwrite(header, 1, sizeof(header), fp) != sizeof(header) ||
+	fwrite(RSTRING_PTR(raw_data), 1, len, fp) != (size_t)len) {
+	fclose(fp);
+	rb_sys_fail(RSTRING_PTR(path));
+    }
+    if (fclose(fp) != 0) {
+	rb_sys_fail(RSTRING_PTR(path));
+    }
+
+    return self;
+}
+
+static VALUE
+im_s_mmap(VALUE klass, VALUE path)
+{
+#ifdef HAVE_SYS_MMAN_H
+    const unsigned char *p;
+    struct stat st;
+    unsigned long width, height, quality, format;
+    struct jp_map *mp;
+    VALUE obj, owner;
+    void *map;
+    int fd;
+
+    FilePathValue(path);
+    fd = open(RSTRING_PTR(path), O_RDONLY);
+    if (fd < 0) {
+	rb_sys_fail(RSTRING_PTR(path));
+    }
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	rb_sys_fail(RSTRING_PTR(path));
+    }
+    if (st.st_size < JP_DUMP_HEADER) {
+	close(fd);
+	rb_raise(eJpegError, "not a dumped image");
+    }
+    owner = jp_map_new(&mp);
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	rb_sys_fail("mmap");
+    }
+    mp->addr = map;
+    mp->len = st.st_size;
+
+    p = (const unsigned char *)map;
+    width = jp_get_le(p + 8, 4);
+    height = jp_get_le(p + 12, 4);
+    quality = jp_get_le(p + 16, 4);
+    format = jp_get_le(p + 20, 4);
+    if (memcmp(p, JP_DUMP_MAGIC, 8) != 0 || format >= JP_FMT_MAX ||
+	(double)width * height * jp_formats[format].components > (double)(st.st_size - JP_DUMP_HEADER)) {
+	rb_raise(eJpegError, "not a dumped image");
+    }
+
+    obj = rb_class_new_instance(0, 0, klass);
+    rb_iv_set(obj, "raw_data", jp_map_str(obj, owner, (const char *)p + JP_DUMP_HEADER,
+	      width * height * jp_formats[format].components));
+    rb_iv_set(obj, "width", ULONG2NUM(width));
+    rb_iv_set(obj, "height", ULONG2NUM(height));
+    rb_iv_set(obj, "quality", ULONG2NUM(quality));
+    rb_iv_set(obj, "format", jp_format_sym(&jp_formats[format]));
+
+    return obj;
+#else
+    rb_notimplement();
+    return Qnil;		/* not reached */
+#endif
+}
+
+define_accessor(cImage, im, raw_data);
+define_accessor(cImage, im, width);
+define_accessor(cImage, im, height);
+define_accessor(cImage, im, quality);
+
+struct reader_st {
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    VALUE io;
+    int open;
+    int aborted;
+    long width;
+    long height;
+    const struct jp_format *fmt;
+    const struct jp_format *out;
+    JSAMPROW line;
+};
+
+static VALUE
+rd_close(VALUE self)
+{
+    struct reader_st *rdp;
+
+    Data_Get_Struct(self, struct reader_st, rdp);
+    if (rdp->open > 1) {
+	rdp->open--;
+	jpeg_finish_decompress(&rdp->dinfo);
+    }
+    if (rdp->open > 0) {
+	rdp->open--;
+	jpeg_destroy_decompress(&rdp->dinfo);
+    }
+
+    return Qnil;
+}
+
+static VALUE
+rd_s_open(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE obj;
+
+    obj = rb_obj_alloc(klass);
+    rb_obj_call_init(obj, argc, argv);
+
+    if (rb_block_given_p()) {
+        rb_ensure(rb_yield, obj, rd_close, obj);
+	return Qnil;
+    }
+    else {
+	return obj;
+    }
+}
+
+/* cannot call IO methods in GC, so only releases the memory */
+static void
+rd_free(struct reader_st *rdp)
+{
+    if (rdp) {
+	if (rdp->open > 0) {
+	    rdp->open--;
+	    jpeg_destroy_decompress(&rdp->dinfo);
+	}
+	free(rdp);
+    }
+}
+
+static void
+rd_mark(struct reader_st *rdp)
+{
+    rb_gc_mark(rdp->io);
+}
+
+static VALUE
+rd_alloc(VALUE klass)
+{
+    return Data_Wrap_Struct(klass, rd_mark, rd_free, 0);
+}
+
+static VALUE
+rd_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE src, opts = Qnil, v;
+    struct reader_st *rdp;
+    const struct jp_format *fmt = &jp_formats[JP_FMT_RGB];
+    long limit;
+
+    rb_scan_args(argc, argv, "11", &src, &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+    }
+    v = jp_opt(opts, "format");
+    if (!NIL_P(v)) {
+	fmt = jp_format_of(v);
+    }
+    limit = jp_opt_limit(opts);
+
+    rdp = ALLOC(struct reader_st);
+    rdp->io = src;
+    rdp->open = 0;
+    rdp->aborted = 0;
+    DATA_PTR(self) = rdp;
+
+    rdp->dinfo.err = jpeg_std_error(&rdp->jerr);
+    rdp->jerr.error_exit = jp_error_exit;
+    jpeg_create_decompress(&rdp->dinfo);
+    rdp->open++;
+    jp_io_src(&rdp->dinfo, src, opts);
+    jp_set_max_memory((j_common_ptr)&rdp->dinfo, opts);
+
+    jpeg_read_header(&rdp->dinfo, 1);
+    jp_check_limit(&rdp->dinfo, limit);
+    rdp->width = rdp->dinfo.image_width;
+    rdp->height = rdp->dinfo.image_height;
+
+    rdp->fmt = fmt;
+    rdp->out = jp_setup_decompress(&rdp->dinfo, fmt);
+    rdp->line = NULL;
+
+    return self;
+}
+
+/* decompression is started by the first each or each_scan */
+static void
+rd_start(struct reader_st *rdp, int buffered)
+{
+    if (rdp->open < 1) {
+	rb_raise(eJpegError, "not opened");
+    }
+    if (rdp->aborted) {
+	rb_raise(eJpegError, "already read");
+    }
+    if (rdp->open == 1) {
+	rdp->dinfo.buffered_image = buffered;
+	jpeg_start_decompress(&rdp->dinfo);
+	rdp->open++;
+	if (rdp->out != rdp->fmt) {
+	    rdp->line = (*rdp->dinfo.mem->alloc_small)((j_common_ptr)&rdp->dinfo, JPOOL_IMAGE,
+		    rdp->dinfo.output_width * rdp->out->components);
+	}
+    }
+    else if (rdp->dinfo.buffered_image != buffered) {
+	rb_raise(eJpegError, "already read");
+    }
+}
+
+static VALUE
+rd_each_body(VALUE arg)
+{
+    struct jp_timed_args *ap = (struct jp_timed_args *)arg;
+    VALUE self = ap->self;
+    struct reader_st *rdp;
+    long size;
+    char *buf;
+    double pos = 0.0;
+    JDIMENSION start;
+
+    Data_Get_Struct(self, struct reader_st, rdp);
+    rd_start(rdp, 0);
+
+    jp_timer_start(&ap->tm);
+    if (ap->tm.on) {
+	pos = jp_src_pos(&rdp->dinfo);
+    }
+    start = rdp->dinfo.output_scanline;
+    size = rdp->dinfo.image_width * rdp->fmt->components;
+    buf = ALLOCA_N(char, size);
+    while (rdp->dinfo.output_scanline < rdp->dinfo.image_height) {
+	jp_read_line(&rdp->dinfo, rdp->out, rdp->fmt, (JSAMPROW)buf, rdp->line);
+	rb_yield(rb_str_new(buf, size));
+    }
+    if (ap->tm.on) {
+	pos = jp_src_pos(&rdp->dinfo) - pos;
+    }
+    jp_timer_stop(&ap->tm, JP_OP_READER_EACH,
+		  (double)(rdp->dinfo.output_scanline - start) * rdp->width, pos);
+
+    return Qnil;
+}
+
+static VALUE
+rd_each(VALUE self)
+{
+    return jp_timed_call(rd_each_body, JP_OP_READER_EACH, 0, NULL, self);
+}
+
+static VALUE
+rd_each_scan_body(VALUE arg)
+{
+    struct jp_timed_args *ap = (struct jp_timed_args *)arg;
+    int argc = ap->argc;
+    VALUE *argv = ap->argv, self = ap->self;
+    struct reader_st *rdp;
+    VALUE opts = Qnil, v;
+    long max_scans = 0, scans = 0;
+    long size, offset;
+    double pos = 0.0;
+
+    rb_scan_args(argc, argv, "01", &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+	v = rb_hash_aref(opts, ID2SYM(rb_intern("max_scans")));
+	if (!NIL_P(v)) {
+	    max_scans = NUM2LONG(v);
+	    if (max_scans <= 0) {
+		rb_raise(rb_eArgError, "max_scans must be more than 0");
+	    }
+	}
+    }
+
+    Data_Get_Struct(self, struct reader_st, rdp);
+    rd_start(rdp, 1);
+
+    jp_timer_start(&ap->tm);
+    if (ap->tm.on) {
+	pos = jp_src_pos(&rdp->dinfo);
+    }
+    size = rdp->dinfo.output_width * rdp->fmt->components;
+    while (!jpeg_input_complete(&rdp->dinfo)) {
+	VALUE obj, raw_data;
+
+	if (max_scans > 0 && scans >= max_scans) {
+	    /* stop reading here instead of consuming the rest of the stream */
+	    jpeg_abort_decompress(&rdp->dinfo);
+	    rdp->open--;
+	    rdp->aborted = 1;
+	    break;
+	}
+
+	jpeg_start_output(&rdp->dinfo, rdp->dinfo.input_scan_number);
+	obj = rb_class_new_instance(0, 0, cImage);
+	rb_iv_set(obj, "width", LONG2NUM(rdp->dinfo.output_width));
+	rb_iv_set(obj, "height", LONG2NUM(rdp->dinfo.output_height));
+	rb_iv_set(obj, "quality", INT2FIX(100));
+	rb_iv_set(obj, "format", jp_format_sym(rdp->fmt));
+	raw_data = rb_iv_get(obj, "raw_data");
+	rb_str_resize(raw_data, size * rdp->dinfo.output_height);
+	offset = 0;
+	while (rdp->dinfo.output_scanline < rdp->dinfo.output_height) {
+	    JSAMPROW work = (JSAMPROW)&RSTRING_PTR(raw_data)[offset];
+	    jp_read_line(&rdp->dinfo, rdp->out, rdp->fmt, work, rdp->line);
+	    offset += size;
+	}
+	jpeg_finish_output(&rdp->dinfo);
+	scans++;
+	rb_yield(obj);
+    }
+    if (ap->tm.on) {
+	pos = jp_src_pos(&rdp->dinfo) - pos;
+    }
+    jp_timer_stop(&ap->tm, JP_OP_READER_EACH_SCAN,
+		  (double)scans * rdp->width * rdp->height, pos);
+
+    return LONG2NUM(scans);
+}
+
+static VALUE
+rd_each_scan(int argc, VALUE *argv, VALUE self)
+{
+    return jp_timed_call(rd_each_scan_body, JP_OP_READER_EACH_SCAN, argc, argv, self);
+}
+
+static VALUE
+rd_progressive_p(VALUE self)
+{
+    struct reader_st *rdp;
+
+    Data_Get_Struct(self, struct reader_st, rdp);
+    if (rdp->open < 1) {
+	rb_raise(eJpegError, "not opened");
+    }
+
+    return jpeg_has_multiple_scans(&rdp->dinfo) ? Qtrue : Qfalse;
+}
+
+static VALUE
+rd_get_width(VALUE self)
+{
+    struct reader_st *rdp;
+
+    Data_Get_Struct(self, struct reader_st, rdp);
+    if (rdp->open < 1) {
+	rb_raise(eJpegError, "not opened");
+    }
+
+    return LONG2NUM(rdp->width);
+}
+
+static VALUE
+rd_get_height(VALUE self)
+{
+    struct reader_st *rdp;
+
+    Data_Get_Struct(self, struct reader_st, rdp);
+    if (rdp->open < 1) {
+	rb_raise(eJpegError, "not opened");
+    }
+
+    return LONG2NUM(rdp->height);
+}
+
+static VALUE
+rd_get_format(VALUE self)
+{
+    struct reader_st *rdp;
+
+    Data_Get_Struct(self, struct reader_st, rdp);
+    if (rdp->open < 1) {
+	rb_raise(eJpegError, "not opened");
+    }
+
+    return jp_format_sym(rdp->fmt);
+}
+
+struct writer_st {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    VALUE io;
+    int open;
+    long width;
+    long height;
+    int quality;
+    const struct jp_format *fmt;
+    const struct jp_format *in;
+    JSAMPROW line;
+};
+
+static VALUE
+wr_close(VALUE self)
+{
+    struct writer_st *wrp;
+
+    Data_Get_Struct(self, struct writer_st, wrp);
+    if (wrp->open > 2) {
+	wrp->open -= 2;
+	jpeg_finish_compress(&wrp->cinfo);
+    }
+    if (wrp->open > 0) {
+	wrp->open--;
+	jpeg_destroy_compress(&wrp->cinfo);
+    }
+
+    return Qnil;
+}
+
+static VALUE
+wr_s_open(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE obj;
+
+    obj = rb_obj_alloc(klass);
+    rb_obj_call_init(obj, argc, argv);
+
+    if (rb_block_given_p()) {
+        rb_ensure(rb_yield, obj, wr_close, obj);
+	return Qnil;
+    }
+    else {
+	return obj;
+    }
+}
+
+/* cannot call IO methods in GC, so only releases the memory */
+static void
+wr_free(struct writer_st *wrp)
+{
+    if (wrp) {
+	if (wrp->open > 0) {
+	    wrp->open--;
+	    jpeg_destroy_compress(&wrp->cinfo);
+	}
+	free(wrp);
+    }
+}
+
+static void
+wr_mark(struct writer_st *wrp)
+{
+    rb_gc_mark(wrp->io);
+}
+
+static VALUE
+wr_alloc(VALUE klass)
+{
+    return Data_Wrap_Struct(klass, wr_mark, wr_free, 0);
+}
+
+static VALUE
+wr_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE dest;
+    VALUE width, height, quality, gray = Qfalse, opts = Qnil;
+    struct writer_st *wrp;
+    struct jp_wopts wo;
+    const struct jp_format *fmt;
+
+    rb_scan_args(argc, argv, "42", &dest, &width, &height, &quality, &gray, &opts);
+    if (NIL_P(opts) && TYPE(gray) == T_HASH) {
+	opts = gray;
+	gray = Qfalse;
+    }
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+    }
+    if (NUM2LONG(width) <= 0) {
+	rb_raise(rb_eArgError, "too small width");
+    }
+    if (NUM2LONG(height) <= 0) {
+	rb_raise(rb_eArgError, "too small height");
+    }
+    if (FIX2INT(quality) < 0 || FIX2INT(quality) > 100) {
+	rb_raise(rb_eArgError, "quality must be between 1 to 100");
+    }
+    jp_write_opts(opts, &wo);
+    wo.threads = 1;
+    if (SYMBOL_P(gray)) {
+	fmt = jp_format_of(gray);
+    }
+    else {
+	fmt = &jp_formats[RTEST(gray) ? JP_FMT_GRAY : JP_FMT_RGB];
+    }
+
+    wrp = ALLOC(struct writer_st);
+    wrp->io = dest;
+    wrp->open = 0;
+    wrp->width = NUM2LONG(width);
+    wrp->height = NUM2LONG(height);
+    wrp->quality = FIX2INT(quality);
+    DATA_PTR(self) = wrp;
+
+    wrp->cinfo.err = jpeg_std_error(&wrp->jerr);
+    wrp->jerr.error_exit = jp_error_exit;
+    jpeg_create_compress(&wrp->cinfo);
+    wrp->open++;
+    jp_io_dest(&wrp->cinfo, dest, opts);
+    jp_set_max_memory((j_common_ptr)&wrp->cinfo, opts);
+    wrp->fmt = fmt;
+    wrp->in = jp_setup_compress(&wrp->cinfo, wrp->width, wrp->height, fmt, wrp->quality, &wo);
+    jpeg_start_compress(&wrp->cinfo, 1);
+    wrp->open++;
+    wrp->line = NULL;
+    if (wrp->in != fmt) {
+	wrp->line = (*wrp->cinfo.mem->alloc_small)((j_common_ptr)&wrp->cinfo, JPOOL_IMAGE,
+		wrp->width * wrp->in->components);
+    }
+
+    return self;
+}
+
+static VALUE
+wr_each_body(VALUE arg)
+{
+    struct jp_timed_args *ap = (struct jp_timed_args *)arg;
+    VALUE self = ap->self;
+    struct writer_st *wrp;
+    long size;
+    double pos = 0.0;
+    JDIMENSION start;
+
+    Data_Get_Struct(self, struct writer_st, wrp);
+    if (wrp->open < 2) {
+	rb_raise(eJpegError, "not opened");
+    }
+
+    jp_timer_start(&ap->tm);
+    if (ap->tm.on) {
+	pos = jp_dest_pos(&wrp->cinfo);
+    }
+    start = wrp->cinfo.next_scanline;
+    size = wrp->cinfo.image_width * wrp->fmt->components;
+    while (wrp->cinfo.next_scanline < wrp->cinfo.image_height) {
+	VALUE line = rb_yield(Qundef);
+	StringValue(line);
+	if (RSTRING_LEN(line) < size) {
+	    rb_raise(rb_eArgError, "too short data passed");
+	}
+	jp_write_line(&wrp->cinfo, wrp->in, wrp->fmt, (JSAMPROW)RSTRING_PTR(line), wrp->line);
+    }
+    wrp->open++;
+    if (ap->tm.on) {
+	pos = jp_dest_pos(&wrp->cinfo) - pos;
+    }
+    jp_timer_stop(&ap->tm, JP_OP_WRITER_EACH,
+		  (double)(wrp->cinfo.next_scanline - start) * wrp->width, pos);
+
+    return Qnil;
+}
+
+static VALUE
+wr_each(VALUE self)
+{
+    return jp_timed_call(wr_each_body, JP_OP_WRITER_EACH, 0, NULL, self);
+}
+
+static VALUE
+wr_get_width(VALUE self)
+{
+    struct writer_st *wrp;
+
+    Data_Get_Struct(self, struct writer_st, wrp);
+    if (wrp->open < 2) {
+	rb_raise(eJpegError, "not opened");
+    }
+
+    return LONG2NUM(wrp->width);
+}
+
+static VALUE
+wr_get_height(VALUE self)
+{
+    struct writer_st *wrp;
+
+    Data_Get_Struct(self, struct writer_st, wrp);
+    if (wrp->open < 2) {
+	rb_raise(eJpegError, "not opened");
+    }
+
+    return LONG2NUM(wrp->height);
+}
+
+static VALUE
+wr_get_quality(VALUE self)
+{
+    struct writer_st *wrp;
+
+    Data_Get_Struct(self, struct writer_st, wrp);
+    if (wrp->open < 2) {
+	rb_raise(eJpegError, "not opened");
+    }
+
+    return INT2FIX(wrp->quality);
+}
+
+static VALUE
+wr_get_format(VALUE self)
+{
+    struct writer_st *wrp;
+
+    Data_Get_Struct(self, struct writer_st, wrp);
+    if (wrp->open < 2) {
+	rb_raise(eJpegError, "not opened");
+    }
+
+    return jp_format_sym(wrp->fmt);
+}
+
+/*
+ * Decoder and Encoder keep one libjpeg object for a stream of frames, such
+ * as Motion JPEG. libjpeg returns to its start state after each frame, so
+ * only the per-image pool is allocated again.
+ */
+struct decoder_st {
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    struct mem_src msrc;
+    VALUE io;			/* or the String of the frames */
+    int open;
+    int busy;			/* a frame was left in the middle */
+    long limit;
+    long frames;
+    const struct jp_format *fmt;
+};
+
+static VALUE
+dec_close(VALUE self)
+{
+    struct decoder_st *decp;
+
+    Data_Get_Struct(self, struct decoder_st, decp);
+    if (decp->open > 0) {
+	decp->open--;
+	jpeg_destroy_decompress(&decp->dinfo);
+    }
+
+    return Qnil;
+}
+
+static VALUE
+dec_s_open(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE obj;
+
+    obj = rb_obj_alloc(klass);
+    rb_obj_call_init(obj, argc, argv);
+
+    if (rb_block_given_p()) {
+	rb_ensure(rb_yield, obj, dec_close, obj);
+	return Qnil;
+    }
+    else {
+	return obj;
+    }
+}
+
+static void
+dec_free(struct decoder_st *decp)
+{
+    if (decp) {
+	if (decp->open > 0) {
+	    jpeg_destroy_decompress(&decp->dinfo);
+	}
+	free(decp);
+    }
+}
+
+static void
+dec_mark(struct decoder_st *decp)
+{
+    rb_gc_mark(decp->io);
+}
+
+static VALUE
+dec_alloc(VALUE klass)
+{
+    return Data_Wrap_Struct(klass, dec_mark, dec_free, 0);
+}
+
+static VALUE
+dec_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE src, opts = Qnil, v;
+    struct decoder_st *decp;
+    const struct jp_format *fmt = NULL;
+    long limit;
+
+    rb_scan_args(argc, argv, "11", &src, &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+    }
+    v = jp_opt(opts, "format");
+    if (!NIL_P(v)) {
+	fmt = jp_format_of(v);
+    }
+    limit = jp_opt_limit(opts);
+    if (RB_TYPE_P(src, T_STRING)) {
+	/* a snapshot, so that the caller cannot modify it while decoding */
+	src = rb_str_new_frozen(src);
+    }
+
+    decp = ALLOC(struct decoder_st);
+    decp->io = src;
+    decp->open = 0;
+    decp->busy = 0;
+    decp->limit = limit;
+    decp->frames = 0;
+    decp->fmt = fmt;
+    DATA_PTR(self) = decp;
+
+    decp->dinfo.err = jpeg_std_error(&decp->jerr);
+    decp->jerr.error_exit = jp_error_exit;
+    jpeg_create_decompress(&decp->dinfo);
+    decp->open++;
+    if (RB_TYPE_P(src, T_STRING)) {
+	jp_mem_src(&decp->dinfo, &decp->msrc, (const JOCTET *)RSTRING_PTR(src), RSTRING_LEN(src));
+    }
+    else {
+	jp_io_src(&decp->dinfo, src, opts);
+    }
+    jp_set_max_memory((j_common_ptr)&decp->dinfo, opts);
+
+    return self;
+}
+
+/*
+ * skips the bytes before the next SOI marker, such as padding or the
+ * rest of a broken frame. returns 0 at the end of the stream.
+ */
+static int
+dec_find_soi(struct decoder_st *decp)
+{
+    struct jpeg_source_mgr *src = decp->dinfo.src;
+    const JOCTET *p;
+
+    for (;;) {
+	p = NULL;
+	if (src->bytes_in_buffer > 0) {
+	    p = memchr(src->next_input_byte, 0xFF, src->bytes_in_buffer);
+	}
+	if (p == NULL) {
+	    src->bytes_in_buffer = 0;
+	}
+	else {
+	    src->bytes_in_buffer -= p - src->next_input_byte;
+	    src->next_input_byte = p;
+	    if (src->bytes_in_buffer >= 2) {
+		if (p[1] == 0xD8) {	/* SOI */
+		    return 1;
+		}
+		src->next_input_byte++;
+		src->bytes_in_buffer--;
+		continue;
+	    }
+	}
+	if (src->fill_input_buffer != rbio_fill_input_buffer ||
+	    rbio_read_more(&decp->dinfo) <= 0) {
+	    return 0;
+	}
+    }
+}
+
+static VALUE
+dec_read_body(VALUE arg)
+{
+    struct jp_timed_args *ap = (struct jp_timed_args *)arg;
+    int argc = ap->argc;
+    VALUE *argv = ap->argv, self = ap->self;
+    struct decoder_st *decp;
+    j_decompress_ptr dinfo;
+    VALUE img = Qnil, raw_data;
+    const struct jp_format *fmt, *out;
+    JSAMPROW line = NULL;
+    long size, offset;
+    double pos = 0.0;
+
+    rb_scan_args(argc, argv, "01", &img);
+    if (!NIL_P(img) && !rb_obj_is_kind_of(img, cImage)) {
+	rb_raise(rb_eTypeError, "need JPEG::Image");
+    }
+    Data_Get_Struct(self, struct decoder_st, decp);
+    if (decp->open < 1) {
+	rb_raise(eJpegError, "not opened");
+    }
+    dinfo = &decp->dinfo;
+    if (decp->busy) {
+	/* an exception left the last frame */
+	const JOCTET *head = RB_TYPE_P(decp->io, T_STRING) ?
+	    (const JOCTET *)RSTRING_PTR(decp->io) : ((struct rbio_src *)dinfo->src)->buf;
+	const JOCTET *p = dinfo->src->next_input_byte;
+
+	jpeg_abort_decompress(dinfo);
+	decp->busy = 0;
+	/* the marker which broke it may be the SOI of the next frame */
+	if (p && p - head >= 2 && p[-2] == 0xFF && p[-1] == 0xD8) {
+	    dinfo->src->next_input_byte -= 2;
+	    dinfo->src->bytes_in_buffer += 2;
+	}
+    }
+
+    jp_timer_start(&ap->tm);
+    if (ap->tm.on && !RB_TYPE_P(decp->io, T_STRING)) {
+	pos = jp_src_pos(dinfo);
+    }
+    if (!dec_find_soi(decp)) {
+	return Qnil;
+    }
+    decp->busy = 1;
+    jpeg_read_header(dinfo, 1);
+    jp_check_limit(dinfo, decp->limit);
+    out = jp_setup_decompress(dinfo, decp->fmt);
+    fmt = decp->fmt ? decp->fmt : out;
+    jpeg_start_decompress(dinfo);
+
+    if (NIL_P(img)) {
+	img = rb_obj_alloc(cImage);
+	rb_obj_call_init(img, 0, NULL);
+    }
+    /* the pixels of img are overwritten, and its buffer is reused */
+    raw_data = rb_iv_get(img, "raw_data");
+    if (!RB_TYPE_P(raw_data, T_STRING)) {
+	raw_data = rb_str_new(0, 0);
+    }
+    size = dinfo->output_width * fmt->components;
+    rb_str_modify(raw_data);
+    rb_str_resize(raw_data, size * dinfo->output_height);
+    if (out != fmt) {
+	line = (*dinfo->mem->alloc_small)((j_common_ptr)dinfo, JPOOL_IMAGE,
+					  dinfo->output_width * out->components);
+    }
+    offset = 0;
+    while (dinfo->output_scanline < dinfo->output_height) {
+	jp_read_line(dinfo, out, fmt, (JSAMPROW)&RSTRING_PTR(raw_data)[offset], line);
+	offset += size;
+    }
+    rb_iv_set(img, "width", LONG2NUM(dinfo->output_width));
+    rb_iv_set(img, "height", LONG2NUM(dinfo->output_height));
+    rb_iv_set(img, "quality", INT2FIX(100));
+    rb_iv_set(img, "format", jp_format_sym(fmt));
+    rb_iv_set(img, "raw_data", raw_data);
+    jpeg_finish_decompress(dinfo);
+    decp->busy = 0;
+    decp->frames++;
+
+    if (ap->tm.on) {
+	pos = RB_TYPE_P(decp->io, T_STRING) ?
+	    (double)(RSTRING_LEN(decp->io) - dinfo->src->bytes_in_buffer) :
+	    jp_src_pos(dinfo) - pos;
+    }
+    jp_timer_stop(&ap->tm, JP_OP_DECODER_READ, (double)dinfo->output_width * dinfo->output_height, pos);
+
+    return img;
+}
+
+static VALUE
+dec_read(int argc, VALUE *argv, VALUE self)
+{
+    return jp_timed_call(dec_read_body, JP_OP_DECODER_READ, argc, argv, self);
+}
+
+static VALUE
+dec_each(int argc, VALUE *argv, VALUE self)
+{
+    VALUE img;
+    long n = 0;
+
+    while (!NIL_P(img = dec_read(argc, argv, self))) {
+	rb_yield(img);
+	n++;
+    }
+
+    return LONG2NUM(n);
+}
+
+static VALUE
+dec_get_frames(VALUE self)
+{
+    struct decoder_st *decp;
+
+    Data_Get_Struct(self, struct decoder_st, decp);
+
+    return LONG2NUM(decp->frames);
+}
+
+struct encoder_st {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct str_dest sdest;	/* for encode */
+    struct jpeg_destination_mgr *iodest;
+    VALUE io;
+    int open;
+    int busy;			/* a frame was left in the middle */
+    int quality;		/* 0 to take the quality of each image */
+    struct jp_wopts wo;
+    long frames;
+};
+
+static VALUE
+enc_close(VALUE self)
+{
+    struct encoder_st *encp;
+
+    Data_Get_Struct(self, struct encoder_st, encp);
+    if (encp->open > 0) {
+	encp->open--;
+	jpeg_destroy_compress(&encp->cinfo);
+    }
+
+    return Qnil;
+}
+
+static VALUE
+enc_s_open(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE obj;
+
+    obj = rb_obj_alloc(klass);
+    rb_obj_call_init(obj, argc, argv);
+
+    if (rb_block_given_p()) {
+	rb_ensure(rb_yield, obj, enc_close, obj);
+	return Qnil;
+    }
+    else {
+	return obj;
+    }
+}
+
+static void
+enc_free(struct encoder_st *encp)
+{
+    if (encp) {
+	if (encp->open > 0) {
+	    jpeg_destroy_compress(&encp->cinfo);
+	}
+	free(encp);
+    }
+}
+
+static void
+enc_mark(struct encoder_st *encp)
+{
+    rb_gc_mark(encp->io);
+}
+
+static VALUE
+enc_alloc(VALUE klass)
+{
+    return Data_Wrap_Struct(klass, enc_mark, enc_free, 0);
+}
+
+static VALUE
+enc_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE dest = Qnil, opts = Qnil, v;
+    struct encoder_st *encp;
+    int quality = 0;
+
+    rb_scan_args(argc, argv, "02", &dest, &opts);
+    if (NIL_P(opts) && TYPE(dest) == T_HASH) {
+	opts = dest;
+	dest = Qnil;
+    }
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
+    }
+    v = jp_opt(opts, "quality");
+    if (!NIL_P(v)) {
+	quality = NUM2INT(v);
+	if (quality <= 0 || quality > 100) {
+	    rb_raise(rb_eArgError, "quality must be between 1 to 100");
+	}
+    }
+
+    encp = ALLOC(struct encoder_st);
+    encp->io = dest;
+    encp->open = 0;
+    encp->busy = 0;
+    encp->quality = quality;
+    encp->frames = 0;
+    encp->iodest = NULL;
+    memset(&encp->sdest, 0, sizeof(encp->sdest));
+    jp_write_opts(opts, &encp->wo);
+    encp->wo.threads = 1;
+    DATA_PTR(self) = encp;
+
+    encp->cinfo.err = jpeg_std_error(&encp->jerr);
+    encp->jerr.error_exit = jp_error_exit;
+    jpeg_create_compress(&encp->cinfo);
+    encp->open++;
+    if (!NIL_P(dest)) {
+	jp_io_dest(&encp->cinfo, dest, opts);
+	encp->iodest = encp->cinfo.dest;
+    }
+    jp_set_max_memory((j_common_ptr)&encp->cinfo, opts);
+
+    return self;
+}
+
+/* compresses img to the destination of cinfo */
+static void
+enc_frame(struct encoder_st *encp, VALUE img)
+{
+    j_compress_ptr cinfo = &encp->cinfo;
+    const struct jp_format *fmt, *in;
+    VALUE raw_data;
+    long width, height, size, offset;
+    int quality;
+    JSAMPROW line = NULL;
+
+    if (!rb_obj_is_kind_of(img, cImage)) {
+	rb_raise(rb_eTypeError, "need JPEG::Image");
+    }
+    fmt = jp_image_format(img);
+    raw_data = rb_iv_get(img, "raw_data");
+    width = NUM2LONG(rb_iv_get(img, "width"));
+    height = NUM2LONG(rb_iv_get(img, "height"));
+    quality = encp->quality ? encp->quality : FIX2INT(rb_iv_get(img, "quality"));
+    if (width <= 0 || height <= 0 || quality <= 0 || quality > 100) {
+	rb_raise(rb_eArgError, "invalid internal paramter");
+    }
+    if (RSTRING_LEN(raw_data) < width * height * fmt->components) {
+	rb_raise(rb_eArgError, "raw_data is smaller than width and height");
+    }
+    if (encp->busy) {
+	/* an exception left the last frame */
+	jp_str_dest_abort(encp->iodest);
+	jp_str_dest_abort(&encp->sdest.pub);
+	jpeg_abort_compress(cinfo);
+	encp->busy = 0;
+    }
+
+    encp->busy = 1;
+    in = jp_setup_compress(cinfo, width, height, fmt, quality, &encp->wo);
+    jpeg_start_compress(cinfo, 1);
+    if (in != fmt) {
+	line = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_IMAGE, width * in->components);
+    }
+    size = width * fmt->components;
+    for (offset = 0; cinfo->next_scanline < (unsigned long)height; offset += size) {
+	jp_write_line(cinfo, in, fmt, (JSAMPROW)&RSTRING_PTR(raw_data)[offset], line);
+    }
+    jpeg_finish_compress(cinfo);
+    encp->busy = 0;
+    encp->frames++;
+}
+
+struct enc_frame_args {
+    struct encoder_st *encp;
+    VALUE img;
+};
+
+static VALUE
+enc_frame_body(VALUE arg)
+{
+    struct enc_frame_args *ap = (struct enc_frame_args *)arg;
+
+    enc_frame(ap->encp, ap->img);
+    return Qnil;
+}
+
+/* drops the incomplete frame from a String at once */
+static VALUE
+enc_frame_ensure(VALUE arg)
+{
+    struct enc_frame_args *ap = (struct enc_frame_args *)arg;
+
+    jp_str_dest_abort(ap->encp->cinfo.dest);
+    return Qnil;
+}
+
+static void
+enc_frame_protect(struct encoder_st *encp, VALUE img)
+{
+    struct enc_frame_args args;
+
+    args.encp = encp;
+    args.img = img;
+    rb_ensure(enc_frame_body, (VALUE)&args, enc_frame_ensure, (VALUE)&args);
+}
+
+static struct encoder_st *
+enc_get(VALUE self)
+{
+    struct encoder_st *encp;
+
+    Data_Get_Struct(self, struct encoder_st, encp);
+    if (encp->open < 1) {
+	rb_raise(eJpegError, "not opened");
+    }
+
+    return encp;
+}
+
+static VALUE
+enc_write_body(VALUE arg)
+{
+    struct jp_timed_args *ap = (struct jp_timed_args *)arg;
+    VALUE self = ap->self, img = ap->argv[0];
+    struct encoder_st *encp = enc_get(self);
+    double pos = 0.0;
+
+    if (!encp->iodest) {
+	rb_raise(eJpegError, "no io to write");
+    }
+    jp_timer_start(&ap->tm);
+    encp->cinfo.dest = encp->iodest;
+    if (ap->tm.on) {
+	pos = jp_dest_pos(&encp->cinfo);
+    }
+    enc_frame_protect(encp, img);
+    if (ap->tm.on) {
+	pos = jp_dest_pos(&encp->cinfo) - pos;
+    }
+    jp_timer_stop(&ap->tm, JP_OP_ENCODER_WRITE,
+		  (double)encp->cinfo.image_width * encp->cinfo.image_height, pos);
+
+    return self;
+}
+
+static VALUE
+enc_write(VALUE self, VALUE img)
+{
+    return jp_timed_call(enc_write_body, JP_OP_ENCODER_WRITE, 1, &img, self);
+}
+
+static VALUE
+enc_encode_body(VALUE arg)
+{
+    struct jp_timed_args *ap = (struct jp_timed_args *)arg;
+    VALUE self = ap->self, img = ap->argv[0];
+    struct encoder_st *encp = enc_get(self);
+    VALUE str = rb_str_buf_new(0);
+
+    jp_timer_start(&ap->tm);
+    jp_str_dest_set(&encp->cinfo, &encp->sdest, str);
+    enc_frame_protect(encp, img);
+    jp_timer_stop(&ap->tm, JP_OP_ENCODER_WRITE,
+		  (double)encp->cinfo.image_width * encp->cinfo.image_height,
+		  (double)RSTRING_LEN(str));
+
+    return str;
+}
+
+static VALUE
+enc_encode(VALUE self, VALUE img)
+{
+    return jp_timed_call(enc_encode_body, JP_OP_ENCODER_WRITE, 1, &img, self);
+}
+
+static VALUE
+enc_get_frames(VALUE self)
+{
+    struct encoder_st *encp;
+
+    Data_Get_Struct(self, struct encoder_st, encp);
+
+    return LONG2NUM(encp->frames);
+}
+
+/*
+ * suspending data source for IncrementalDecoder.
+ * fill_input_buffer returns FALSE until more data is fed, then libjpeg
+ * returns JPEG_SUSPENDED and retries from the same position later.
+ */
+struct inc_src {
+    struct jpeg_source_mgr pub;
+    JOCTET *buf;
+    size_t cap;
+    size_t skip;
+    double fed;
+    int eof;
+};
+
+static const JOCTET inc_fake_eoi[2] = { 0xFF, JPEG_EOI };
+
+static void
+inc_init_source(j_decompress_ptr dinfo)
+{
+}
 
-    width = NUM2LONG(rb_iv_get(self, "width"));
-    height = NUM2LONG(rb_iv_get(self, "height"));
-    src = rb_iv_get(self, "raw_data");
-    components = RTEST(rb_iv_get(self, "gray_p")) ? 1 : 3;
-    dest = rb_str_new(NULL, 0);
-    rb_str_resize(dest, width * height * components);
+static boolean
+inc_fill_input_buffer(j_decompress_ptr dinfo)
+{
+    struct inc_src *src = (struct inc_src *)dinfo->src;
 
-    memset(hist, 0, sizeof(hist));
-    min = 255; max = 0;
-    for (y = 0; y < height; ++y) {
-	for (x = 0; x < width; ++x) {
-	    unsigned char *p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * components];
-	    unsigned char gray = components > 1 ? grayscale(p[0], p[1], p[2]) : *p;
-	    min = min(gray, min);
-	    max = max(gray, max);
-	    hist[gray]++;
-	}
+    if (!src->eof) {
+	return FALSE;
     }
 
-    half = width * height / 2;
-    median = 128;
-    sum = 0;
-    for (i = 0; i < (long)sizeof(hist); ++i) {
-	sum += hist[i];
-	if (sum >= half) {
-	    median = i;
-	    break;
-	}
-    }
+    /* no more data will come; insert a fake EOI like jdatasrc.c does */
+    WARNMS(dinfo, JWRN_JPEG_EOF);
+    src->pub.next_input_byte = inc_fake_eoi;
+    src->pub.bytes_in_buffer = 2;
+    return TRUE;
+}
 
-    low = median - min;
-    high = max - median;
-    if (low && high) {
-	for (y = 0; y < height; ++y) {
-	    for (x = 0; x < width; ++x) {
-		unsigned char *p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * components];
-		unsigned char *q = (unsigned char *)&RSTRING_PTR(dest)[(x + y * width) * components];
-		int i;
-		for (i = 0; i < components; ++i) {
-		    q[i] = p[i] < median ? (p[i] - min) * 127 / low : (p[i] - median) * 127 / high + 128;
-		}
-	    }
-	}
+static void
+inc_skip_input_data(j_decompress_ptr dinfo, long num_bytes)
+{
+    struct inc_src *src = (struct inc_src *)dinfo->src;
+
+    if (num_bytes <= 0) {
+	return;
+    }
+    if ((size_t)num_bytes <= src->pub.bytes_in_buffer) {
+	src->pub.next_input_byte += num_bytes;
+	src->pub.bytes_in_buffer -= num_bytes;
     }
     else {
-	memcpy(RSTRING_PTR(dest), RSTRING_PTR(src), width * height * components);
+	/* skip the rest when it is fed */
+	src->skip += num_bytes - src->pub.bytes_in_buffer;
+	src->pub.next_input_byte += src->pub.bytes_in_buffer;
+	src->pub.bytes_in_buffer = 0;
     }
+}
 
-    jpeg = rb_class_new_instance(0, 0, cImage);
-    rb_iv_set(jpeg, "raw_data", dest);
-    rb_iv_set(jpeg, "width", LONG2NUM(width));
-    rb_iv_set(jpeg, "height", LONG2NUM(height));
-    rb_iv_set(jpeg, "quality", INT2FIX(100));
-    rb_iv_set(jpeg, "gray_p", rb_iv_get(self, "gray_p"));
+static void
+inc_term_source(j_decompress_ptr dinfo)
+{
+}
 
-    return jpeg;
+enum {
+    INC_HEADER,
+    INC_START,
+    INC_SCAN,
+    INC_FINISH,
+    INC_DONE
+};
+
+struct incdec_st {
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    struct inc_src src;
+    JSAMPROW row;
+    int state;
+    int busy;
+    long limit;
+};
+
+static void
+inc_free(struct incdec_st *idp)
+{
+    if (idp) {
+	jpeg_destroy_decompress(&idp->dinfo);
+	xfree(idp->src.buf);
+	xfree(idp->row);
+	xfree(idp);
+    }
 }
 
 static VALUE
-im_grayscale(VALUE self)
+inc_alloc(VALUE klass)
 {
-    VALUE jpeg;
-    long width;
-    long height;
-    VALUE src;
-    VALUE dest;
-    long x, y;
-
-    width = NUM2LONG(rb_iv_get(self, "width"));
-    height = NUM2LONG(rb_iv_get(self, "height"));
-    src = rb_iv_get(self, "raw_data");
-    dest = rb_str_new(NULL, 0);
-    rb_str_resize(dest, width * height);
-    if (RTEST(rb_iv_get(self, "gray_p"))) {
-	memcpy(RSTRING_PTR(dest), RSTRING_PTR(src), width * height);
-    }
-    else {
-	unsigned char *q = (unsigned char *)RSTRING_PTR(dest);
-	for (y = 0; y < height; ++y) {
-	    for (x = 0; x < width; ++x, ++q) {
-		unsigned char *p = (unsigned char *)&RSTRING_PTR(src)[x * 3 + y * width * 3];
-		*q = grayscale(p[0], p[1], p[2]);
-	    }
-	}
-    }
+    struct incdec_st *idp;
+    VALUE obj;
 
-    jpeg = rb_class_new_instance(0, 0, cImage);
-    rb_iv_set(jpeg, "raw_data", dest);
-    rb_iv_set(jpeg, "width", LONG2NUM(width));
-    rb_iv_set(jpeg, "height", LONG2NUM(height));
-    rb_iv_set(jpeg, "quality", INT2FIX(100));
-    rb_iv_set(jpeg, "gray_p", Qtrue);
+    obj = Data_Make_Struct(klass, struct incdec_st, 0, inc_free, idp);
+    idp->dinfo.err = jpeg_std_error(&idp->jerr);
+    idp->jerr.error_exit = jp_error_exit;
+    jpeg_create_decompress(&idp->dinfo);
+
+    idp->src.pub.init_source = inc_init_source;
+    idp->src.pub.fill_input_buffer = inc_fill_input_buffer;
+    idp->src.pub.skip_input_data = inc_skip_input_data;
+    idp->src.pub.resync_to_restart = jpeg_resync_to_restart;
+    idp->src.pub.term_source = inc_term_source;
+    idp->src.pub.next_input_byte = NULL;
+    idp->src.pub.bytes_in_buffer = 0;
+    idp->dinfo.src = &idp->src.pub;
+    idp->limit = jp_max_pixels;
 
-    return jpeg;
+    return obj;
 }
 
 static VALUE
-im_level(int argc, VALUE *argv, VALUE self)
+inc_initialize(int argc, VALUE *argv, VALUE self)
 {
-    VALUE l, h, adj = Qfalse;
-    int low, high, d;
-    VALUE jpeg;
-    long width, height;
-    VALUE src, dest;
-    long x, y;
-    int components;
+    struct incdec_st *idp;
+    VALUE opts = Qnil;
 
-    rb_scan_args(argc, argv, "21", &l, &h, &adj);
-    low = NUM2LONG(l);
-    high = NUM2LONG(h);
-    if (low < 0 || low > 100 || high < 0 || high > 100) {
-	rb_raise(rb_eArgError, "level must be between 1 to 100");
-    }
-    if (low >= high) {
-	rb_raise(rb_eArgError, "low must be less than high");
+    rb_scan_args(argc, argv, "01", &opts);
+    if (!NIL_P(opts)) {
+	Check_Type(opts, T_HASH);
     }
-    low = low * 256 / 100;
-    high = high * 256 / 100;
-    d = high - low;
+    Data_Get_Struct(self, struct incdec_st, idp);
+    idp->limit = jp_opt_limit(opts);
+    jp_set_max_memory((j_common_ptr)&idp->dinfo, opts);
 
-    width = NUM2LONG(rb_iv_get(self, "width"));
-    height = NUM2LONG(rb_iv_get(self, "height"));
-    src = rb_iv_get(self, "raw_data");
-    components = RTEST(rb_iv_get(self, "gray_p")) ? 1 : 3;
-    dest = rb_str_new(NULL, 0);
-    rb_str_resize(dest, width * height * components);
+    return self;
+}
 
-    for (y = 0; y < height; ++y) {
-	for (x = 0; x < width; ++x) {
-	    unsigned char *p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * components];
-	    unsigned char *q = (unsigned char *)&RSTRING_PTR(dest)[(x + y * width) * components];
-	    int i;
-	    for (i = 0; i < components; ++i) {
-		q[i] = p[i] < low ? 0 : p[i] >= high ? 255 : RTEST(adj) ? (p[i] - low) * d / 256 : p[i];
-	    }
-	}
-    }
+static struct incdec_st *
+inc_get(VALUE self)
+{
+    struct incdec_st *idp;
 
-    jpeg = rb_class_new_instance(0, 0, cImage);
-    rb_iv_set(jpeg, "raw_data", dest);
-    rb_iv_set(jpeg, "width", LONG2NUM(width));
-    rb_iv_set(jpeg, "height", LONG2NUM(height));
-    rb_iv_set(jpeg, "quality", INT2FIX(100));
-    rb_iv_set(jpeg, "gray_p", rb_iv_get(self, "gray_p"));
+    Data_Get_Struct(self, struct incdec_st, idp);
+    if (idp->busy) {
+	/* libjpeg raised an error in the middle of the previous call */
+	rb_raise(eJpegError, "broken by a previous error");
+    }
 
-    return jpeg;
+    return idp;
 }
 
 static VALUE
-im_clip(int argc, VALUE *argv, VALUE self)
+inc_feed(VALUE self, VALUE str)
 {
-    long x1, y1, x2, y2;
-    long width, height;
-    long dwidth, dheight;
-    long x, y;
-    long i;
-    int components;
-    VALUE src, dest;
-    VALUE jpeg;
-
-    if (argc != 0 && argc != 4) {
-	rb_raise(rb_eArgError,
-		 "wrong number of arguments(%d for 0 or 4)", argc);
+    struct incdec_st *idp = inc_get(self);
+    struct inc_src *src = &idp->src;
+    const char *ptr;
+    size_t len, rest;
+
+    StringValue(str);
+    if (src->eof) {
+	rb_raise(eJpegError, "already finished");
+    }
+    ptr = RSTRING_PTR(str);
+    len = RSTRING_LEN(str);
+    src->fed += len;
+    if (src->skip > 0) {
+	size_t n = src->skip < len ? src->skip : len;
+	ptr += n;
+	len -= n;
+	src->skip -= n;
     }
 
-    src = rb_iv_get(self, "raw_data");
-    components = RTEST(rb_iv_get(self, "gray_p")) ? 1 : 3;
+    /* keep the bytes libjpeg has not consumed yet at the head of buf */
+    rest = src->pub.bytes_in_buffer;
+    if (rest > 0 && src->pub.next_input_byte != src->buf) {
+	memmove(src->buf, src->pub.next_input_byte, rest);
+    }
+    if (rest + len > src->cap) {
+	src->cap = (rest + len) * 2;
+	REALLOC_N(src->buf, JOCTET, src->cap);
+    }
+    memcpy(src->buf + rest, ptr, len);
+    src->pub.next_input_byte = src->buf;
+    src->pub.bytes_in_buffer = rest + len;
 
-    width = NUM2LONG(rb_iv_get(self, "width"));
-    height = NUM2LONG(rb_iv_get(self, "height"));
+    return self;
+}
 
-    if (argc == 0) {
-	unsigned char base[3], *p;
+static VALUE
+inc_finish(VALUE self)
+{
+    struct incdec_st *idp = inc_get(self);
 
-	memcpy(base, RSTRING_PTR(src), components);
+    idp->src.eof = 1;
 
-	x1 = width - 1;
-	y1 = height - 1;
-	for (y = 0; y < height; ++y) {
-	    for (x = 0; x <= x1; ++x) {
-		p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * components];
-		for (i = 0; i < components; ++i) {
-		    if (p[i] != base[i]) {
-			x1 = x;
-			if (y < y1) y1 = y;
-			break;
-		    }
-		}
-	    }
-	}
+    return self;
+}
 
-	x2 = x1;
-	y2 = y1;
-	for (y = height - 1; y >= 0; --y) {
-	    for (x = width - 1; x >= x2; --x) {
-		p = (unsigned char *)&RSTRING_PTR(src)[(x + y * width) * components];
-		for (i = 0; i < components; ++i) {
-		    if (p[i] != base[i]) {
-			x2 = x;
-			if (y > y2) y2 = y;
-			break;
-		    }
-		}
-	    }
+/* proceeds as far as the fed data allows and returns the current state */
+static int
+inc_advance(struct incdec_st *idp)
+{
+    idp->busy = 1;
+    if (idp->state == INC_HEADER) {
+	if (jpeg_read_header(&idp->dinfo, 1) != JPEG_SUSPENDED) {
+	    /* this leaves busy set, so the decoder cannot be used any more */
+	    jp_check_limit(&idp->dinfo, idp->limit);
+	    jp_setup_decompress(&idp->dinfo, NULL);
+	    idp->state = INC_START;
 	}
-
-	if (x1 == x2 || y1 == y2) {
-	    return Qnil;
+    }
+    if (idp->state == INC_START) {
+	if (jpeg_start_decompress(&idp->dinfo)) {
+	    idp->row = ALLOC_N(JSAMPLE, idp->dinfo.output_width * idp->dinfo.output_components);
+	    idp->state = INC_SCAN;
 	}
     }
-    else {
-	x1 = NUM2LONG(argv[0]);
-	y1 = NUM2LONG(argv[1]);
-	x2 = NUM2LONG(argv[2]);
-	y2 = NUM2LONG(argv[3]);
-	if (x1 >= x2 || y1 >= y2) {
-	    rb_raise(rb_eArgError, "wrong combination of arguments");
+    if (idp->state == INC_SCAN &&
+	idp->dinfo.output_scanline >= idp->dinfo.output_height) {
+	idp->state = INC_FINISH;
+    }
+    if (idp->state == INC_FINISH) {
+	if (jpeg_finish_decompress(&idp->dinfo)) {
+	    idp->state = INC_DONE;
 	}
     }
+    idp->busy = 0;
 
-    dwidth = x2 - x1 + 1;
-    dheight = y2 - y1 + 1;
-    dest = rb_str_new(NULL, 0);
-    rb_str_resize(dest, dwidth * dheight * components);
-    memset(RSTRING_PTR(dest), 0xFF, dwidth * dheight * components);
+    return idp->state;
+}
 
-    for (y = y1; y <= y2 && y < height; ++y) {
-	unsigned char *p = (unsigned char *)&RSTRING_PTR(src)[(x1 + y * width) * components];
-	unsigned char *q = (unsigned char *)&RSTRING_PTR(dest)[(y - y1) * dwidth * components];
-	memcpy(q, p, dwidth * components);
-    }
+static VALUE
+inc_each_row_body(VALUE arg)
+{
+    struct jp_timed_args *ap = (struct jp_timed_args *)arg;
+    VALUE self = ap->self;
+    struct incdec_st *idp = inc_get(self);
+    long size;
+    long rows = 0;
+    double pos = 0.0;
 
-    RB_GC_GUARD(dest);	/* need? */
+    jp_timer_start(&ap->tm);
+    if (ap->tm.on) {
+	pos = idp->src.fed - idp->src.pub.bytes_in_buffer;
+    }
+    while (inc_advance(idp) == INC_SCAN) {
+	JDIMENSION n;
 
-    jpeg = rb_class_new_instance(0, 0, cImage);
-    rb_iv_set(jpeg, "raw_data", dest);
-    rb_iv_set(jpeg, "width", LONG2NUM(dwidth));
-    rb_iv_set(jpeg, "height", LONG2NUM(dheight));
-    rb_iv_set(jpeg, "quality", INT2FIX(100));
-    rb_iv_set(jpeg, "gray_p", rb_iv_get(self, "gray_p"));
+	idp->busy = 1;
+	n = jpeg_read_scanlines(&idp->dinfo, &idp->row, 1);
+	idp->busy = 0;
+	if (n == 0) {
+	    break;
+	}
+	size = idp->dinfo.output_width * idp->dinfo.output_components;
+	rows++;
+	rb_yield(rb_str_new((const char *)idp->row, size));
+    }
+    if (ap->tm.on) {
+	pos = idp->src.fed - idp->src.pub.bytes_in_buffer - pos;
+    }
+    jp_timer_stop(&ap->tm, JP_OP_INCREMENTAL_EACH,
+		  (double)rows * idp->dinfo.output_width, pos);
 
-    return rb_ary_new3(5, jpeg, LONG2NUM(x1), LONG2NUM(y1), LONG2NUM(x2), LONG2NUM(y2));
+    return LONG2NUM(rows);
 }
 
 static VALUE
-im_gray_p(VALUE self)
+inc_each_row(VALUE self)
 {
-    return rb_iv_get(self, "gray_p");
+    RETURN_ENUMERATOR(self, 0, 0);
+
+    return jp_timed_call(inc_each_row_body, JP_OP_INCREMENTAL_EACH, 0, NULL, self);
 }
 
-define_accessor(cImage, im, raw_data);
-define_accessor(cImage, im, width);
-define_accessor(cImage, im, height);
-define_accessor(cImage, im, quality);
+static VALUE
+inc_header_p(VALUE self)
+{
+    struct incdec_st *idp = inc_get(self);
 
-struct reader_st {
-    struct jpeg_decompress_struct dinfo;
-    struct jpeg_error_mgr jerr;
-    int open;
-    long width;
-    long height;
-};
+    return inc_advance(idp) > INC_HEADER ? Qtrue : Qfalse;
+}
 
 static VALUE
-rd_close(VALUE self)
+inc_done_p(VALUE self)
 {
-    struct reader_st *rdp;
-
-    Data_Get_Struct(self, struct reader_st, rdp);
-    if (rdp->open > 1) {
-	rdp->open--;
-	jpeg_finish_decompress(&rdp->dinfo);
-    }
-    if (rdp->open > 0) {
-	rdp->open--;
-	jpeg_destroy_decompress(&rdp->dinfo);
-    }
+    struct incdec_st *idp = inc_get(self);
 
-    return Qnil;
+    return inc_advance(idp) == INC_DONE ? Qtrue : Qfalse;
 }
 
 static VALUE
-rd_s_open(VALUE klass, VALUE src)
+inc_get_width(VALUE self)
 {
-    VALUE obj;
-
-    obj = rb_obj_alloc(klass);
-    rb_obj_call_init(obj, 1, &src);
+    struct incdec_st *idp = inc_get(self);
 
-    if (rb_block_given_p()) {
-        rb_ensure(rb_yield, obj, rd_close, obj);
+    if (inc_advance(idp) == INC_HEADER) {
 	return Qnil;
     }
-    else {
-	return obj;
-    }
+
+    return LONG2NUM(idp->dinfo.image_width);
 }
 
-static void
-rd_free(struct reader_st *rdp)
+static VALUE
+inc_get_height(VALUE self)
 {
-    if (rdp) {
-	if (rdp->open > 1) {
-	    rdp->open--;
-	    jpeg_finish_decompress(&rdp->dinfo);
-	}
-	if (rdp->open > 0) {
-	    rdp->open--;
-	    jpeg_destroy_decompress(&rdp->dinfo);
-	}
-	free(rdp);
+    struct incdec_st *idp = inc_get(self);
+
+    if (inc_advance(idp) == INC_HEADER) {
+	return Qnil;
     }
+
+    return LONG2NUM(idp->dinfo.image_height);
 }
 
 static VALUE
-rd_alloc(VALUE klass)
+inc_gray_p(VALUE self)
 {
-    return Data_Wrap_Struct(klass, 0, rd_free, 0);
+    struct incdec_st *idp = inc_get(self);
+
+    if (inc_advance(idp) == INC_HEADER) {
+	return Qnil;
+    }
+
+    return idp->dinfo.out_color_space == JCS_GRAYSCALE ? Qtrue : Qfalse;
 }
 
 static VALUE
-rd_initialize(VALUE self, VALUE src)
+inc_get_lineno(VALUE self)
 {
-    struct reader_st *rdp;
-    FILE *fp;
-
-    if (TYPE(src) == T_FILE) {
-	OpenFile *fptr;
-	rb_io_binmode(src);
-	GetOpenFile(src, fptr);
-#ifdef GetReadFile
-	fp = GetReadFile(fptr);
-#else
-	fp = rb_io_stdio_file(fptr);
-#endif
-    }
-    else {
-	rb_raise(rb_eTypeError, "need IO");
-    }
+    struct incdec_st *idp = inc_get(self);
 
-    rdp = ALLOC(struct reader_st);
-    rdp->open = 0;
-    DATA_PTR(self) = rdp;
+    return LONG2NUM(idp->state >= INC_SCAN ? idp->dinfo.output_scanline : 0);
+}
 
-    rdp->dinfo.err = jpeg_std_error(&rdp->jerr);
-    rdp->jerr.error_exit = jp_error_exit;
-    jpeg_create_decompress(&rdp->dinfo);
-    rdp->open++;
-    jpeg_stdio_src(&rdp->dinfo, fp);
+/*
+ * LRU cache of decoded and processed images.
+ * the table and the list are only touched while holding GVL and without
+ * calling Ruby code, so they are consistent among threads.
+ */
+struct cache_entry {
+    VALUE key;			/* digest of the data + inspect of the operations */
+    VALUE raw_data;		/* frozen, and shared with the returned images */
+    VALUE format;
+    long width;
+    long height;
+    size_t bytes;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+};
 
-    jpeg_read_header(&rdp->dinfo, 1);
-    rdp->width = rdp->dinfo.image_width;
-    rdp->height = rdp->dinfo.image_height;
+struct cache_st {
+    st_table *tbl;
+    struct cache_entry *head;	/* the most recently used */
+    struct cache_entry *tail;
+    size_t max_bytes;
+    size_t bytes;
+    long hits;
+    long misses;
+    long evictions;
+};
 
-    rdp->dinfo.output_components = 3;
-    rdp->dinfo.out_color_space = JCS_RGB;
-    jpeg_start_decompress(&rdp->dinfo);
-    rdp->open++;
+static int
+cache_key_cmp(st_data_t a, st_data_t b)
+{
+    VALUE x = (VALUE)a, y = (VALUE)b;
 
-    return self;
+    return RSTRING_LEN(x) != RSTRING_LEN(y) ||
+	memcmp(RSTRING_PTR(x), RSTRING_PTR(y), RSTRING_LEN(x)) != 0;
 }
 
-static VALUE
-rd_each(VALUE self)
+static st_index_t
+cache_key_hash(st_data_t a)
 {
-    struct reader_st *rdp;
-    long size;
-    char *buf;
+    return (st_index_t)rb_memhash(RSTRING_PTR((VALUE)a), RSTRING_LEN((VALUE)a));
+}
 
-    Data_Get_Struct(self, struct reader_st, rdp);
-    if (rdp->open < 2) {
-	rb_raise(eJpegError, "not opened");
+static const struct st_hash_type cache_key_type = {
+    cache_key_cmp,
+    cache_key_hash,
+};
+
+static void
+cache_unlink(struct cache_st *cp, struct cache_entry *ep)
+{
+    if (ep->prev) {
+	ep->prev->next = ep->next;
+    }
+    else {
+	cp->head = ep->next;
     }
+    if (ep->next) {
+	ep->next->prev = ep->prev;
+    }
+    else {
+	cp->tail = ep->prev;
+    }
+    ep->prev = ep->next = NULL;
+}
 
-    size = rdp->dinfo.image_width * rdp->dinfo.output_components;
-    buf = ALLOCA_N(char, size);
-    while (rdp->dinfo.output_scanline < rdp->dinfo.image_height) {
-	JSAMPROW work = (JSAMPROW)buf;
-	jpeg_read_scanlines(&rdp->dinfo, (JSAMPARRAY)&work , 1);
-	rb_yield(rb_str_new(buf, size));
+static void
+cache_push(struct cache_st *cp, struct cache_entry *ep)
+{
+    ep->prev = NULL;
+    ep->next = cp->head;
+    if (cp->head) {
+	cp->head->prev = ep;
+    }
+    cp->head = ep;
+    if (!cp->tail) {
+	cp->tail = ep;
     }
+}
 
-    return Qnil;
+static void
+cache_remove(struct cache_st *cp, struct cache_entry *ep)
+{
+    st_data_t key = (st_data_t)ep->key;
+
+    st_delete(cp->tbl, &key, NULL);
+    cache_unlink(cp, ep);
+    cp->bytes -= ep->bytes;
+    xfree(ep);
 }
 
-static VALUE
-rd_get_width(VALUE self)
+static void
+cache_mark(struct cache_st *cp)
 {
-    struct reader_st *rdp;
+    struct cache_entry *ep;
 
-    Data_Get_Struct(self, struct reader_st, rdp);
-    if (rdp->open < 2) {
-	rb_raise(eJpegError, "not opened");
+    for (ep = cp->head; ep; ep = ep->next) {
+	rb_gc_mark(ep->key);
+	rb_gc_mark(ep->raw_data);
+	rb_gc_mark(ep->format);
     }
+}
 
-    return LONG2NUM(rdp->width);
+static void
+cache_free(struct cache_st *cp)
+{
+    while (cp->head) {
+	cache_remove(cp, cp->head);
+    }
+    st_free_table(cp->tbl);
+    xfree(cp);
 }
 
 static VALUE
-rd_get_height(VALUE self)
+cache_alloc(VALUE klass)
 {
-    struct reader_st *rdp;
+    struct cache_st *cp;
+    VALUE obj;
 
-    Data_Get_Struct(self, struct reader_st, rdp);
-    if (rdp->open < 2) {
-	rb_raise(eJpegError, "not opened");
-    }
+    obj = Data_Make_Struct(klass, struct cache_st, cache_mark, cache_free, cp);
+    cp->tbl = st_init_table(&cache_key_type);
 
-    return LONG2NUM(rdp->height);
+    return obj;
 }
 
-struct writer_st {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    int open;
-    long width;
-    long height;
-    int quality;
-};
+static struct cache_st *
+cache_get(VALUE self)
+{
+    struct cache_st *cp;
+
+    Data_Get_Struct(self, struct cache_st, cp);
+
+    return cp;
+}
 
 static VALUE
-wr_close(VALUE self)
+cache_initialize(VALUE self, VALUE max_bytes)
 {
-    struct writer_st *wrp;
-
-    Data_Get_Struct(self, struct writer_st, wrp);
-    if (wrp->open > 2) {
-	wrp->open -= 2;
-	jpeg_finish_compress(&wrp->cinfo);
-    }
-    if (wrp->open > 0) {
-	wrp->open--;
-	jpeg_destroy_compress(&wrp->cinfo);
+    if (NUM2LONG(max_bytes) <= 0) {
+	rb_raise(rb_eArgError, "max_bytes must be more than 0");
     }
+    cache_get(self)->max_bytes = NUM2LONG(max_bytes);
 
-    return Qnil;
+    return self;
 }
 
+/* returns a new image sharing the cached pixels, or nil */
 static VALUE
-wr_s_open(int argc, VALUE *argv, VALUE klass)
+cache_lookup(struct cache_st *cp, VALUE key)
 {
-    VALUE obj;
-
-    obj = rb_obj_alloc(klass);
-    rb_obj_call_init(obj, argc, argv);
+    st_data_t val;
+    struct cache_entry *ep;
+    VALUE img;
 
-    if (rb_block_given_p()) {
-        rb_ensure(rb_yield, obj, wr_close, obj);
+    if (!st_lookup(cp->tbl, (st_data_t)key, &val)) {
 	return Qnil;
     }
-    else {
-	return obj;
-    }
+    ep = (struct cache_entry *)val;
+    cache_unlink(cp, ep);
+    cache_push(cp, ep);
+
+    img = rb_class_new_instance(0, 0, cImage);
+    rb_iv_set(img, "raw_data", rb_str_dup(ep->raw_data));
+    rb_iv_set(img, "width", LONG2NUM(ep->width));
+    rb_iv_set(img, "height", LONG2NUM(ep->height));
+    rb_iv_set(img, "quality", INT2FIX(100));
+    rb_iv_set(img, "format", ep->format);
+
+    return img;
 }
 
 static void
-wr_free(struct writer_st *wrp)
+cache_store(struct cache_st *cp, VALUE key, VALUE img)
 {
-    if (wrp) {
-	if (wrp->open > 2) {
-	    wrp->open -= 2;
-	    jpeg_finish_compress(&wrp->cinfo);
-	}
-	if (wrp->open > 0) {
-	    wrp->open--;
-	    jpeg_destroy_compress(&wrp->cinfo);
-	}
-	free(wrp);
+    struct cache_entry *ep;
+    VALUE raw_data = rb_str_new_frozen(rb_iv_get(img, "raw_data"));
+    VALUE format = rb_iv_get(img, "format");
+    long width = NUM2LONG(rb_iv_get(img, "width"));
+    long height = NUM2LONG(rb_iv_get(img, "height"));
+    size_t bytes = RSTRING_LEN(raw_data) + RSTRING_LEN(key) + sizeof(struct cache_entry);
+
+    jp_format_of(format);
+    if (bytes > cp->max_bytes || st_lookup(cp->tbl, (st_data_t)key, NULL)) {
+	/* too large, or another thread has stored it */
+	return;
+    }
+    while (cp->bytes + bytes > cp->max_bytes) {
+	cache_remove(cp, cp->tail);
+	cp->evictions++;
     }
+
+    ep = ALLOC(struct cache_entry);
+    ep->key = rb_str_new_frozen(key);
+    ep->raw_data = raw_data;
+    ep->format = format;
+    ep->width = width;
+    ep->height = height;
+    ep->bytes = bytes;
+    cache_push(cp, ep);
+    st_insert(cp->tbl, (st_data_t)ep->key, (st_data_t)ep);
+    cp->bytes += bytes;
+    /* raw_data is also shared with img; modifying img copies it */
+    rb_iv_set(img, "raw_data", rb_str_dup(raw_data));
 }
 
+/* digest/sha2 is required in Init_jpeg, since other Ractors cannot require */
 static VALUE
-wr_alloc(VALUE klass)
+cache_digest(VALUE data)
 {
-    return Data_Wrap_Struct(klass, 0, wr_free, 0);
+    return rb_funcall(rb_path2class("Digest::SHA256"), rb_intern("digest"), 1, data);
 }
 
+/*
+ * the key of the decoded image: the digest and the options which change its
+ * pixels in a fixed order. the others, such as threads, limits and the
+ * callbacks, and the order of the keys do not make other entries.
+ */
 static VALUE
-wr_initialize(int argc, VALUE *argv, VALUE self)
+cache_base_key(VALUE digest, VALUE opts)
 {
-    VALUE dest;
-    VALUE width, height, quality, gray = Qfalse;
-    struct writer_st *wrp;
-    FILE *fp;
+    VALUE key = rb_str_dup(digest);
+    VALUE v = jp_opt(opts, "format");
+    VALUE raw = jp_opt(opts, "raw");
 
-    rb_scan_args(argc, argv, "41", &dest, &width, &height, &quality, &gray);
-    if (TYPE(dest) == T_FILE) {
-	OpenFile *fptr;
-	rb_io_binmode(dest);
-	GetOpenFile(dest, fptr);
-#ifdef GetWriteFile
-	fp = GetWriteFile(fptr);
-#else
-	fp = rb_io_stdio_file(fptr);
-#endif
+    rb_str_catf(key, "format=%s,auto_orient=%d,raw=%d",
+		NIL_P(v) ? "" : jp_format_of(v)->name,
+		RTEST(jp_opt(opts, "auto_orient")), !NIL_P(raw) && raw != Qfalse);
+
+    return key;
+}
+
+static VALUE
+cache_apply(VALUE img, VALUE op)
+{
+    VALUE ret;
+
+    if (SYMBOL_P(op)) {
+	ret = rb_funcallv_public(img, SYM2ID(op), 0, NULL);
     }
     else {
-	rb_raise(rb_eTypeError, "need IO");
-    }
-    if (NUM2LONG(width) <= 0) {
-	rb_raise(rb_eArgError, "too small width");
+	Check_Type(op, T_ARRAY);
+	if (RARRAY_LEN(op) < 1 || !SYMBOL_P(RARRAY_AREF(op, 0))) {
+	    rb_raise(rb_eArgError, "operation must be a Symbol or [Symbol, *args]");
+	}
+	ret = rb_funcallv_public(img, SYM2ID(RARRAY_AREF(op, 0)),
+				 (int)RARRAY_LEN(op) - 1, RARRAY_CONST_PTR(op) + 1);
     }
-    if (NUM2LONG(height) <= 0) {
-	rb_raise(rb_eArgError, "too small height");
+    /* clip returns [img, x1, y1, x2, y2] */
+    if (RB_TYPE_P(ret, T_ARRAY) && RARRAY_LEN(ret) > 0) {
+	ret = RARRAY_AREF(ret, 0);
     }
-    if (FIX2INT(quality) < 0 || FIX2INT(quality) > 100) {
-	rb_raise(rb_eArgError, "quality must be between 1 to 100");
+    if (!rb_obj_is_kind_of(ret, cImage)) {
+	rb_raise(rb_eTypeError, "operation must return JPEG::Image");
     }
 
-    wrp = ALLOC(struct writer_st);
-    wrp->open = 0;
-    wrp->width = NUM2LONG(width);
-    wrp->height = NUM2LONG(height);
-    wrp->quality = FIX2INT(quality);
-    DATA_PTR(self) = wrp;
+    return ret;
+}
 
-    wrp->cinfo.err = jpeg_std_error(&wrp->jerr);
-    wrp->jerr.error_exit = jp_error_exit;
-    jpeg_create_compress(&wrp->cinfo);
-    wrp->open++;
-    jpeg_stdio_dest(&wrp->cinfo, fp);
+static VALUE
+cache_fetch(int argc, VALUE *argv, VALUE self)
+{
+    struct cache_st *cp = cache_get(self);
+    VALUE src, ops, opts = Qnil, data, digest, key, base_key, img;
+    VALUE read_argv[2];
+    long i;
 
-    wrp->cinfo.image_width = wrp->width;
-    wrp->cinfo.image_height = wrp->height;
-    if (RTEST(gray)) {
-	wrp->cinfo.input_components = 1;
-	wrp->cinfo.in_color_space = JCS_GRAYSCALE;
+    rb_scan_args(argc, argv, "1*", &src, &ops);
+    if (RARRAY_LEN(ops) > 0 && RB_TYPE_P(RARRAY_AREF(ops, RARRAY_LEN(ops) - 1), T_HASH)) {
+	opts = rb_ary_pop(ops);
+    }
+    if (RB_TYPE_P(src, T_STRING)) {
+	data = rb_str_new_frozen(src);
     }
     else {
-	wrp->cinfo.input_components = 3;
-	wrp->cinfo.in_color_space = JCS_RGB;
-    }
-    wrp->cinfo.progressive_mode = 1;
-    jpeg_set_defaults(&wrp->cinfo);
-    jpeg_set_quality(&wrp->cinfo, wrp->quality, 0);
-    wrp->cinfo.optimize_coding = 1;
-    wrp->cinfo.dct_method = JDCT_ISLOW;
-    jpeg_start_compress(&wrp->cinfo, 1);
-    wrp->open++;
+	if (!rb_respond_to(src, rb_intern("read"))) {
+	    rb_raise(rb_eTypeError, "need IO");
+	}
+	jp_binmode(src);
+	data = rb_funcall(src, rb_intern("read"), 0);
+	StringValue(data);
+    }
 
-    return self;
+    digest = cache_digest(data);
+    base_key = cache_base_key(digest, opts);
+    key = rb_str_plus(base_key, rb_inspect(ops));
+    img = cache_lookup(cp, key);
+    if (!NIL_P(img)) {
+	cp->hits++;
+	return img;
+    }
+    cp->misses++;
+
+    /* the decoded image is shared by all the operation chains */
+    img = RARRAY_LEN(ops) > 0 ? cache_lookup(cp, base_key) : Qnil;
+    if (NIL_P(img)) {
+	read_argv[0] = data;
+	read_argv[1] = opts;
+	img = jp_s_read(NIL_P(opts) ? 1 : 2, read_argv, mJpeg);
+	if (RARRAY_LEN(ops) > 0) {
+	    cache_store(cp, base_key, img);
+	}
+    }
+    for (i = 0; i < RARRAY_LEN(ops); ++i) {
+	img = cache_apply(img, RARRAY_AREF(ops, i));
+    }
+    cache_store(cp, key, img);
+
+    return img;
 }
 
 static VALUE
-wr_each(VALUE self)
+cache_clear(VALUE self)
 {
-    struct writer_st *wrp;
-    long size;
-
-    Data_Get_Struct(self, struct writer_st, wrp);
-    if (wrp->open < 2) {
-	rb_raise(eJpegError, "not opened");
-    }
+    struct cache_st *cp = cache_get(self);
 
-    size = wrp->cinfo.image_width * wrp->cinfo.input_components;
-    while (wrp->cinfo.next_scanline < wrp->cinfo.image_height) {
-	JSAMPROW work;
-	VALUE line = rb_yield(Qundef);
-	StringValue(line);
-	if (RSTRING_LEN(line) < size) {
-	    rb_raise(rb_eArgError, "too short data passed");
-	}
-	work = (JSAMPROW)RSTRING_PTR(line);
-	jpeg_write_scanlines(&wrp->cinfo, (JSAMPARRAY)&work , 1);
+    while (cp->head) {
+	cache_remove(cp, cp->head);
     }
-    wrp->open++;
 
-    return Qnil;
+    return self;
 }
 
 static VALUE
-wr_get_width(VALUE self)
+cache_get_hits(VALUE self)
 {
-    struct writer_st *wrp;
+    return LONG2NUM(cache_get(self)->hits);
+}
 
-    Data_Get_Struct(self, struct writer_st, wrp);
-    if (wrp->open < 2) {
-	rb_raise(eJpegError, "not opened");
-    }
+static VALUE
+cache_get_misses(VALUE self)
+{
+    return LONG2NUM(cache_get(self)->misses);
+}
 
-    return LONG2NUM(wrp->width);
+static VALUE
+cache_get_evictions(VALUE self)
+{
+    return LONG2NUM(cache_get(self)->evictions);
 }
 
 static VALUE
-wr_get_height(VALUE self)
+cache_get_bytes(VALUE self)
 {
-    struct writer_st *wrp;
+    return SIZET2NUM(cache_get(self)->bytes);
+}
 
-    Data_Get_Struct(self, struct writer_st, wrp);
-    if (wrp->open < 2) {
-	rb_raise(eJpegError, "not opened");
-    }
+static VALUE
+cache_get_max_bytes(VALUE self)
+{
+    return SIZET2NUM(cache_get(self)->max_bytes);
+}
 
-    return LONG2NUM(wrp->height);
+static VALUE
+cache_get_size(VALUE self)
+{
+    return SIZET2NUM(cache_get(self)->tbl->num_entries);
 }
 
 static VALUE
-wr_get_quality(VALUE self)
+cache_stats(VALUE self)
 {
-    struct writer_st *wrp;
+    struct cache_st *cp = cache_get(self);
+    VALUE hash = rb_hash_new();
 
-    Data_Get_Struct(self, struct writer_st, wrp);
-    if (wrp->open < 2) {
-	rb_raise(eJpegError, "not opened");
-    }
+    rb_hash_aset(hash, ID2SYM(rb_intern("hits")), LONG2NUM(cp->hits));
+    rb_hash_aset(hash, ID2SYM(rb_intern("misses")), LONG2NUM(cp->misses));
+    rb_hash_aset(hash, ID2SYM(rb_intern("evictions")), LONG2NUM(cp->evictions));
+    rb_hash_aset(hash, ID2SYM(rb_intern("entries")), SIZET2NUM(cp->tbl->num_entries));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), SIZET2NUM(cp->bytes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("max_bytes")), SIZET2NUM(cp->max_bytes));
 
-    return INT2FIX(wrp->quality);
+    return hash;
 }
 
 static VALUE
@@ -1053,7 +6128,9 @@ set_jp_err(int n, const char *name)
 
     err = rb_define_class_under(mJpeg, name, eJpegError);
     rb_define_const(err, "Errno", INT2NUM(n));
-    st_add_direct(jp_err_tbl, n, err);
+    if (n < JMSG_LASTMSGCODE) {
+	jp_err_classes[n] = err;
+    }
 
     return err;
 }
@@ -1061,35 +6138,80 @@ set_jp_err(int n, const char *name)
 void
 Init_jpeg(void)
 {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    rb_ext_ractor_safe(true);
+#endif
+#ifdef HAVE_RUBY_RACTOR_H
+    jp_counters_key = rb_ractor_local_storage_ptr_newkey(&jp_counters_type);
+    jp_hook_key = rb_ractor_local_storage_value_newkey();
+#endif
+
     mJpeg = rb_define_module("JPEG");
-    rb_define_const(mJpeg, "VERSION", rb_str_new2(MY_VERSION));
-    rb_define_singleton_method(mJpeg, "read", jp_s_read, 1);
-    rb_define_singleton_method(mJpeg, "write", jp_s_write, 2);
+    rb_define_const(mJpeg, "VERSION", rb_obj_freeze(rb_str_new2(MY_VERSION)));
+    rb_define_singleton_method(mJpeg, "read", jp_s_read, -1);
+    rb_define_singleton_method(mJpeg, "write", jp_s_write, -1);
+    rb_define_singleton_method(mJpeg, "encode", jp_s_encode, -1);
+    rb_define_singleton_method(mJpeg, "fingerprint", jp_s_fingerprint, -1);
+    rb_define_singleton_method(mJpeg, "buffer_size", jp_s_get_buffer_size, 0);
+    rb_define_singleton_method(mJpeg, "buffer_size=", jp_s_set_buffer_size, 1);
+    rb_define_singleton_method(mJpeg, "max_pixels", jp_s_get_max_pixels, 0);
+    rb_define_singleton_method(mJpeg, "max_pixels=", jp_s_set_max_pixels, 1);
+    rb_define_singleton_method(mJpeg, "max_memory", jp_s_get_max_memory, 0);
+    rb_define_singleton_method(mJpeg, "max_memory=", jp_s_set_max_memory, 1);
+    rb_define_singleton_method(mJpeg, "instrument=", jp_s_set_instrument, 1);
+    rb_define_singleton_method(mJpeg, "instrument?", jp_s_instrument_p, 0);
+    rb_define_singleton_method(mJpeg, "instrument_hook", jp_s_get_instrument_hook, 0);
+    rb_define_singleton_method(mJpeg, "instrument_hook=", jp_s_set_instrument_hook, 1);
+    rb_define_singleton_method(mJpeg, "stats", jp_s_stats, 0);
+    rb_define_singleton_method(mJpeg, "reset_stats", jp_s_reset_stats, 0);
+#ifndef HAVE_RUBY_RACTOR_H
+    rb_global_variable(&jp_hook_main);
+#endif
 
     cImage = rb_define_class_under(mJpeg, "Image", rb_cObject);
     rb_define_method(cImage, "initialize", im_initialize, 0);
-    rb_define_method(cImage, "bilinear", im_bilinear, 2);
-    rb_define_method(cImage, "bicubic", im_bicubic, 2);
+    rb_define_method(cImage, "bilinear", im_bilinear, -1);
+    rb_define_method(cImage, "bicubic", im_bicubic, -1);
+    rb_define_method(cImage, "unsharp", im_unsharp, -1);
+    rb_define_method(cImage, "rotate", im_rotate, 1);
+    rb_define_method(cImage, "flip", im_flip, 0);
+    rb_define_method(cImage, "flop", im_flop, 0);
     rb_define_method(cImage, "auto_contrast", im_contrast, 0);
     rb_define_method(cImage, "grayscale", im_grayscale, 0);
     rb_define_method(cImage, "level", im_level, -1);
     rb_define_method(cImage, "clip", im_clip, -1);
     rb_define_method(cImage, "gray?", im_gray_p, 0);
+    rb_define_method(cImage, "format", im_get_format, 0);
+    rb_define_method(cImage, "format=", im_set_format, 1);
+    rb_define_method(cImage, "dump", im_dump, 1);
+    rb_define_singleton_method(cImage, "mmap", im_s_mmap, 1);
     register_accessor(cImage, im, raw_data);
     register_accessor(cImage, im, width);
     register_accessor(cImage, im, height);
     register_accessor(cImage, im, quality);
 
+    cPlanes = rb_define_class_under(mJpeg, "Planes", rb_cObject);
+    rb_define_method(cPlanes, "initialize", pl_initialize, 0);
+    register_accessor(cPlanes, pl, planes);
+    register_accessor(cPlanes, pl, strides);
+    register_accessor(cPlanes, pl, sampling);
+    register_accessor(cPlanes, pl, width);
+    register_accessor(cPlanes, pl, height);
+    register_accessor(cPlanes, pl, quality);
+
     cReader = rb_define_class_under(mJpeg, "Reader", rb_cObject);
-    rb_define_singleton_method(cReader, "open", rd_s_open, 1);
+    rb_define_singleton_method(cReader, "open", rd_s_open, -1);
     rb_define_alloc_func(cReader, rd_alloc);
-    rb_define_method(cReader, "initialize", rd_initialize, 1);
+    rb_define_method(cReader, "initialize", rd_initialize, -1);
     rb_define_method(cReader, "close", rd_close, 0);
     rb_define_method(cReader, "each", rd_each, 0);
     rb_define_method(cReader, "each_line", rd_each, 0);
     rb_define_method(cReader, "read_each_line", rd_each, 0);
+    rb_define_method(cReader, "each_scan", rd_each_scan, -1);
+    rb_define_method(cReader, "progressive?", rd_progressive_p, 0);
     rb_define_method(cReader, "width", rd_get_width, 0);
     rb_define_method(cReader, "height", rd_get_height, 0);
+    rb_define_method(cReader, "format", rd_get_format, 0);
 
     cWriter = rb_define_class_under(mJpeg, "Writer", rb_cObject);
     rb_define_singleton_method(cWriter, "open", wr_s_open, -1);
@@ -1100,12 +6222,64 @@ Init_jpeg(void)
     rb_define_method(cWriter, "width", wr_get_width, 0);
     rb_define_method(cWriter, "height", wr_get_height, 0);
     rb_define_method(cWriter, "quality", wr_get_quality, 0);
+    rb_define_method(cWriter, "format", wr_get_format, 0);
+
+    cDecoder = rb_define_class_under(mJpeg, "Decoder", rb_cObject);
+    rb_define_singleton_method(cDecoder, "open", dec_s_open, -1);
+    rb_define_alloc_func(cDecoder, dec_alloc);
+    rb_define_method(cDecoder, "initialize", dec_initialize, -1);
+    rb_define_method(cDecoder, "close", dec_close, 0);
+    rb_define_method(cDecoder, "read", dec_read, -1);
+    rb_define_method(cDecoder, "each_frame", dec_each, -1);
+    rb_define_method(cDecoder, "each", dec_each, -1);
+    rb_define_method(cDecoder, "frames", dec_get_frames, 0);
+
+    cEncoder = rb_define_class_under(mJpeg, "Encoder", rb_cObject);
+    rb_define_singleton_method(cEncoder, "open", enc_s_open, -1);
+    rb_define_alloc_func(cEncoder, enc_alloc);
+    rb_define_method(cEncoder, "initialize", enc_initialize, -1);
+    rb_define_method(cEncoder, "close", enc_close, 0);
+    rb_define_method(cEncoder, "write", enc_write, 1);
+    rb_define_method(cEncoder, "<<", enc_write, 1);
+    rb_define_method(cEncoder, "encode", enc_encode, 1);
+    rb_define_method(cEncoder, "frames", enc_get_frames, 0);
+
+    cIncDecoder = rb_define_class_under(mJpeg, "IncrementalDecoder", rb_cObject);
+    rb_define_alloc_func(cIncDecoder, inc_alloc);
+    rb_define_method(cIncDecoder, "initialize", inc_initialize, -1);
+    rb_define_method(cIncDecoder, "feed", inc_feed, 1);
+    rb_define_method(cIncDecoder, "<<", inc_feed, 1);
+    rb_define_method(cIncDecoder, "finish", inc_finish, 0);
+    rb_define_method(cIncDecoder, "each_available_row", inc_each_row, 0);
+    rb_define_method(cIncDecoder, "header?", inc_header_p, 0);
+    rb_define_method(cIncDecoder, "done?", inc_done_p, 0);
+    rb_define_method(cIncDecoder, "width", inc_get_width, 0);
+    rb_define_method(cIncDecoder, "height", inc_get_height, 0);
+    rb_define_method(cIncDecoder, "gray?", inc_gray_p, 0);
+    rb_define_method(cIncDecoder, "lineno", inc_get_lineno, 0);
+
+    cCache = rb_define_class_under(mJpeg, "Cache", rb_cObject);
+    rb_define_alloc_func(cCache, cache_alloc);
+    rb_define_method(cCache, "initialize", cache_initialize, 1);
+    rb_define_method(cCache, "fetch", cache_fetch, -1);
+    rb_define_method(cCache, "clear", cache_clear, 0);
+    rb_define_method(cCache, "hits", cache_get_hits, 0);
+    rb_define_method(cCache, "misses", cache_get_misses, 0);
+    rb_define_method(cCache, "evictions", cache_get_evictions, 0);
+    rb_define_method(cCache, "bytes", cache_get_bytes, 0);
+    rb_define_method(cCache, "max_bytes", cache_get_max_bytes, 0);
+    rb_define_method(cCache, "size", cache_get_size, 0);
+    rb_define_method(cCache, "stats", cache_stats, 0);
+    rb_require("digest/sha2");
 
     eJpegError =
 	rb_define_class_under(mJpeg, "StandardError", rb_eStandardError);
-    jp_err_tbl = st_init_numtable();
 #define JMESSAGE(code,string)	set_jp_err(code, #code);
 #include "jerror.h"
     eJpegUnknownError =
 	rb_define_class_under(mJpeg, "UnknownError", eJpegError);
+    eJpegLimitError =
+	rb_define_class_under(mJpeg, "LimitError", eJpegError);
+    eJpegCancelled =
+	rb_define_class_under(mJpeg, "Cancelled", eJpegError);
 }
@@ -0,0 +1,295 @@
+require "jpeg"
+require "json"
+require "tmpdir"
+require "stringio"
+
+# Benchmark harness for the jpeg extension.
+#
+# Every measurement is written as one JSON object per line, so that the
+# output of two versions can be compared by a script.
+#
+# Environment variables:
+#   BENCH_SIZES   comma separated megapixels (default: 0.1,1,12,50)
+#   BENCH_REPEAT  number of runs per operation; the fastest is reported
+#                 (default: 3)
+#   BENCH_OUTPUT  output file (default: standard output)
+
+SIZES = (ENV["BENCH_SIZES"] || "0.1,1,12,50").split(/,/).map(&:to_f)
+REPEAT = (ENV["BENCH_REPEAT"] || 3).to_i
+OUT = ENV["BENCH_OUTPUT"] ? open(ENV["BENCH_OUTPUT"], "w") : $stdout
+
+TMPDIR = Dir.mktmpdir("jpeg-bench")
+at_exit { FileUtils.remove_entry(TMPDIR) }
+
+ENCODER_SETTINGS = [
+  {quality: 75},
+  {quality: 95},
+]
+
+DECODER_SETTINGS = [
+  {format: :rgb},
+  {format: :bgra},
+  {format: :gray},
+  {threads: 4},
+  {raw: :ycbcr},
+]
+
+def emit(record)
+  OUT.puts JSON.generate(record)
+  OUT.flush
+end
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def reset_peak_rss
+  File.write("/proc/self/clear_refs", "5")
+rescue SystemCallError, IOError
+  nil
+end
+
+def proc_status(key)
+  File.foreach("/proc/self/status") do |line|
+    return line.split[1].to_i if line.start_with?("#{key}:")
+  end
+  nil
+rescue SystemCallError, IOError
+  nil
+end
+
+# Creates a deterministic image of about `mp` megapixels.
+# The content is a gradient with some noise, which compresses like a photo
+# rather than like a flat color.
+def synthetic_image(mp, gray)
+  width = Math.sqrt(mp * 1_000_000 * 4 / 3).round
+  height = (width * 3 / 4.0).round
+  components = 3
+  rnd = Random.new(20070101)
+  period = 64
+  rows = Array.new(period) do |y|
+    noise = rnd.bytes(width * components).unpack("C*")
+    row = Array.new(width * components)
+    width.times do |x|
+      base = x * 255 / width
+      components.times do |c|
+        i = x * components + c
+        row[i] = (base + y * (c + 1) + (noise[i] & 0x1F)) & 0xFF
+      end
+    end
+    row.pack("C*")
+  end
+  raw = String.new(capacity: width * height * components)
+  height.times { |y| raw << rows[y % period] }
+
+  img = JPEG::Image.new
+  img.width = width
+  img.height = height
+  img.quality = 90
+  img.raw_data = raw
+  gray ? img.grayscale : img
+end
+
+# Runs the block REPEAT times and reports the fastest run together with the
+# allocations and the peak RSS of that run.
+def measure(name, params, pixels)
+  best = nil
+  REPEAT.times do
+    GC.start
+    reset_peak_rss
+    rss = proc_status("VmRSS")
+    objects = GC.stat(:total_allocated_objects)
+    gcs = GC.count
+    t = now
+    yield
+    sec = now - t
+    result = {
+      seconds: sec,
+      allocated_objects: GC.stat(:total_allocated_objects) - objects,
+      gc_runs: GC.count - gcs,
+      rss_before_kb: rss,
+      peak_rss_kb: proc_status("VmHWM"),
+    }
+    best = result if !best || sec < best[:seconds]
+  end
+  emit({type: "result", op: name}.merge(params).merge(best).merge(
+    megapixels: pixels / 1_000_000.0,
+    mpix_per_sec: pixels / 1_000_000.0 / best[:seconds],
+  ))
+end
+
+emit(type: "meta", version: JPEG::VERSION, ruby: RUBY_DESCRIPTION,
+     repeat: REPEAT, sizes: SIZES, time: Time.now.utc.to_s)
+
+SIZES.each do |mp|
+  [false, true].each do |gray|
+    src = synthetic_image(mp, gray)
+    pixels = src.width * src.height
+    params = {size_mp: mp, width: src.width, height: src.height,
+              color: gray ? "gray" : "rgb"}
+
+    files = {}
+    ENCODER_SETTINGS.each do |setting|
+      path = File.join(TMPDIR, "bench-#{setting[:quality]}.jpg")
+      src.quality = setting[:quality]
+      measure("write", params.merge(setting), pixels) do
+        open(path, "wb") do |f|
+          JPEG.write(src, f)
+        end
+      end
+      files[setting] = path
+    end
+
+    [1, 4].each do |threads|
+      measure("write(threads)", params.merge(threads: threads), pixels) do
+        open(File.join(TMPDIR, "bench-threads.jpg"), "wb") do |f|
+          JPEG.write(src, f, threads: threads, progressive: false, optimize: false, restart_rows: 1)
+        end
+      end
+      measure("read(threads)", params.merge(threads: threads), pixels) do
+        open(File.join(TMPDIR, "bench-threads.jpg"), "rb") do |f|
+          JPEG.read(f, threads: threads)
+        end
+      end
+    end
+
+    files.each do |setting, path|
+      measure("read", params.merge(setting).merge(bytes: File.size(path)), pixels) do
+        open(path, "rb") do |f|
+          JPEG.read(f)
+        end
+      end
+      measure("read(progress)", params.merge(setting), pixels) do
+        open(path, "rb") do |f|
+          JPEG.read(f, progress: proc {}, deadline: 60)
+        end
+      end
+      measure("fingerprint", params.merge(setting), pixels) do
+        open(path, "rb") do |f|
+          JPEG.fingerprint(f)
+        end
+      end
+      measure("read+grayscale+bilinear(8, 8)", params.merge(setting), pixels) do
+        open(path, "rb") do |f|
+          JPEG.read(f).grayscale.bilinear(8, 8)
+        end
+      end
+      planes = nil
+      DECODER_SETTINGS.each do |decoder|
+        measure("read", params.merge(setting).merge(decoder), pixels) do
+          open(path, "rb") do |f|
+            img = JPEG.read(f, **decoder)
+            planes = img if decoder[:raw]
+          end
+        end
+      end
+      measure("write(planes)", params.merge(setting), pixels) do
+        open(File.join(TMPDIR, "bench-planes.jpg"), "wb") do |f|
+          JPEG.write(planes, f)
+        end
+      end
+      measure("Reader#each", params.merge(setting), pixels) do
+        open(path, "rb") do |f|
+          JPEG::Reader.open(f) do |reader|
+            reader.each {}
+          end
+        end
+      end
+      measure("Reader#each_scan(max_scans: 1)", params.merge(setting), pixels) do
+        open(path, "rb") do |f|
+          JPEG::Reader.open(f) do |reader|
+            reader.each_scan(max_scans: 1) {}
+          end
+        end
+      end
+    end
+
+    budget = File.size(files[ENCODER_SETTINGS[0]]) / 2
+    measure("encode(max_bytes)", params.merge(max_bytes: budget), pixels) do
+      JPEG.encode(src, max_bytes: budget)
+    end
+    measure("write(quality loop)", params.merge(max_bytes: budget), pixels) do
+      lo, hi = 1, src.quality
+      while lo <= hi
+        q = (lo + hi) / 2
+        (JPEG.encode(src, quality: q).bytesize <= budget) ? lo = q + 1 : hi = q - 1
+      end
+    end
+
+    frame = src.bilinear(320, 240)
+    mjpeg = JPEG.encode(frame, progressive: false, optimize: false) * 30
+    measure("read(30 frames)", params.merge(frame: "320x240"), 320 * 240 * 30) do
+      30.times { |i| JPEG.read(mjpeg.byteslice(i * mjpeg.bytesize / 30, mjpeg.bytesize / 30)) }
+    end
+    measure("Decoder#read(30 frames)", params.merge(frame: "320x240"), 320 * 240 * 30) do
+      buffer = JPEG::Image.new
+      JPEG::Decoder.new(StringIO.new(mjpeg)).each_frame(buffer) {}
+    end
+    measure("Encoder#encode(30 frames)", params.merge(frame: "320x240"), 320 * 240 * 30) do
+      encoder = JPEG::Encoder.new(progressive: false, optimize: false)
+      30.times { encoder.encode(frame) }
+    end
+
+    line = src.raw_data[0, src.width * (gray ? 1 : 3)]
+    measure("Writer#write_each_line", params, pixels) do
+      open(File.join(TMPDIR, "bench-lines.jpg"), "wb") do |f|
+        JPEG::Writer.open(f, src.width, src.height, 90, gray) do |writer|
+          writer.write_each_line { line }
+        end
+      end
+    end
+
+    dw = src.width / 3
+    dh = src.height / 3
+    data = File.binread(File.join(TMPDIR, "bench-#{ENCODER_SETTINGS[0][:quality]}.jpg"))
+    cache = JPEG::Cache.new(pixels * 8)
+    measure("Cache#fetch(miss)", params, pixels) do
+      cache.clear
+      cache.fetch(data, [:bilinear, dw, dh])
+    end
+    measure("Cache#fetch(hit)", params, pixels) { cache.fetch(data, [:bilinear, dw, dh]) }
+    unless gray
+      path = File.join(TMPDIR, "bench-#{ENCODER_SETTINGS[0][:quality]}.jpg")
+      bgra = nil
+      measure("read(format: :bgra)", params, pixels) do
+        open(path, "rb") { |f| bgra = JPEG.read(f, format: :bgra) }
+      end
+      measure("write(bgra)", params, pixels) do
+        open(File.join(TMPDIR, "bench-bgra.jpg"), "wb") { |f| JPEG.write(bgra, f) }
+      end
+      dumped = File.join(TMPDIR, "bench-bgra.img")
+      bgra.dump(dumped)
+      measure("Image.mmap", params, pixels) { JPEG::Image.mmap(dumped).bicubic(dw, dh) }
+      measure("read(shared: true)", params, pixels) do
+        open(path, "rb") { |f| JPEG.read(f, shared: true) }
+      end
+      measure("bilinear(bgra)", params, pixels) { bgra.bilinear(dw, dh) }
+      measure("level(bgra)", params, pixels) { bgra.level(10, 90, true) }
+    end
+    measure("bilinear", params, pixels) { src.bilinear(dw, dh) }
+    measure("bicubic", params, pixels) { src.bicubic(dw, dh) }
+    if defined?(Ractor)
+      Warning[:experimental] = false
+      shared = Ractor.make_shareable(src.dup.tap { |img| img.raw_data = src.raw_data.dup })
+      measure("bicubic(4 ractors)", params, pixels * 4) do
+        4.times.map { Ractor.new(shared, dw, dh) { |img, w, h| img.bicubic(w, h).width } }.each(&:take)
+      end
+    end
+    measure("bicubic+unsharp", params, pixels) { src.bicubic(dw, dh).unsharp }
+    measure("bicubic(sharpen: true)", params, pixels) { src.bicubic(dw, dh, sharpen: true) }
+    measure("unsharp", params, pixels) { src.unsharp }
+    measure("rotate(90)", params, pixels) { src.rotate(90) }
+    measure("rotate(180)", params, pixels) { src.rotate(180) }
+    measure("flop", params, pixels) { src.flop }
+    measure("auto_contrast", params, pixels) { src.auto_contrast }
+    measure("level", params, pixels) { src.level(10, 90, true) }
+    measure("grayscale", params, pixels) { src.grayscale }
+    measure("clip(auto)", params, pixels) { src.clip }
+    measure("clip", params, pixels) do
+      src.clip(src.width / 4, src.height / 4, src.width * 3 / 4, src.height * 3 / 4)
+    end
+  end
+  GC.start
+end
+
+OUT.close unless OUT == $stdout
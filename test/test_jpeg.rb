@@ -114,6 +114,378 @@ open("test9.jpg", "wb") do |f|
 end
 
 
+open("test2.jpg", "rb") do |f|
+  full = JPEG.read(f)
+  f.rewind
+  JPEG::Reader.open(f) do |reader|
+    scans = []
+    reader.each_scan { |img| scans << img }
+    puts "test2.jpg: %d scans (%sprogressive)" % [scans.size, reader.progressive?? "" : "not "]
+    raise "each_scan failed" unless scans.size > 1 && scans.last.raw_data == full.raw_data
+  end
+  f.rewind
+  JPEG::Reader.open(f) do |reader|
+    n = reader.each_scan(max_scans: 1) do |img|
+      puts "  first scan: %d x %d" % [img.width, img.height]
+    end
+    raise "each_scan(max_scans: 1) failed" unless n == 1
+  end
+end
+
+[File.join(dir, "test.jpg"), "test2.jpg"].each do |path|
+  data = File.binread(path)
+  full = open(path, "rb") { |f| JPEG.read(f) }
+  decoder = JPEG::IncrementalDecoder.new
+  lines = []
+  first = nil
+  fed = 0
+  (0...data.size).step(4096) do |pos|
+    chunk = data[pos, 4096]
+    decoder.feed(chunk)
+    fed += chunk.bytesize
+    decoder.each_available_row { |line| lines << line }
+    first ||= fed unless lines.empty?
+  end
+  decoder.finish
+  decoder.each_available_row { |line| lines << line }
+  puts "incremental: %s, %d x %d, first row after %d/%d bytes" % [File.basename(path), decoder.width, decoder.height, first, data.size]
+  raise "incremental decoding failed" unless decoder.done? && lines.join == full.raw_data
+end
+
+require "stringio"
+io = StringIO.new("".b)
+JPEG.write(src, io, buffer_size: 1000)
+io.rewind
+img = JPEG.read(io, buffer_size: 333)
+rd, wr = IO.pipe
+writer = Thread.new { wr.write(io.string); wr.close }
+img2 = JPEG.read(rd)
+writer.join
+rd.close
+puts "StringIO : %d bytes, %d x %d, same via pipe: %s" % [io.size, img.width, img.height, img.raw_data == img2.raw_data]
+raise "IO-like objects failed" unless img.raw_data == img2.raw_data && img.width == src.width
+greedy = Object.new
+greedy.instance_variable_set(:@data, io.string.dup)
+def greedy.read(n)
+  # returns more bytes than asked for, up to the rest of the file
+  chunk = @data.slice!(0, n * 3)
+  chunk.empty? ? nil : chunk
+end
+img3 = JPEG.read(greedy, buffer_size: 333)
+raise "surplus of read failed" unless img3.raw_data == img.raw_data
+
+events = []
+JPEG.reset_stats
+JPEG.instrument = true
+JPEG.instrument_hook = lambda { |name, payload| events << name }
+open(File.join(dir, "test.jpg"), "rb") do |f|
+  JPEG.read(f).grayscale
+end
+broken = begin
+  JPEG.read(StringIO.new("\xFF\xD8\xFF\xD9".b))
+rescue JPEG::StandardError
+  true
+end
+JPEG.instrument_hook = nil
+JPEG.instrument = false
+stats = JPEG.stats
+puts "instrument: read %d call, %d pixels, %d bytes, %.3f sec; hooked %s" % [stats["read"][:calls], stats["read"][:pixels], stats["read"][:bytes], stats["read"][:wall_time], events.join(", ")]
+raise "instrument failed" unless events == ["read", "grayscale", "read"] && stats["read"][:bytes] == File.size(File.join(dir, "test.jpg"))
+raise "instrument of raised call failed" unless broken == true && stats["read"][:calls] == 2
+
+big = src.bilinear(src.width * 2, src.height * 2)
+par = StringIO.new("".b)
+JPEG.write(big, par, threads: 4)
+ser = StringIO.new("".b)
+JPEG.write(big, ser, progressive: false, optimize: false, restart_rows: 1)
+par.rewind
+img = JPEG.read(par)
+puts "threads  : %d bytes, same as serial: %s" % [par.size, par.string == ser.string]
+raise "parallel encoding failed" unless par.string == ser.string && img.width == big.width && img.height == big.height
+img2 = JPEG.read(StringIO.new(par.string), threads: 4)
+puts "threads  : decoded %d x %d, same as serial: %s" % [img2.width, img2.height, img2.raw_data == img.raw_data]
+raise "parallel decoding failed" unless img2.raw_data == img.raw_data
+# the serial decoder stops at EOI, while the split one counts the whole String
+trailed = par.string + "trailer".b
+JPEG.reset_stats
+JPEG.instrument = true
+JPEG.read(trailed, threads: 1)
+serial_bytes = JPEG.stats["read"][:bytes]
+JPEG.reset_stats
+JPEG.read(trailed, threads: 4)
+split_bytes = JPEG.stats["read"][:bytes]
+JPEG.instrument = false
+raise "serial fallback of threads: 1 failed" unless serial_bytes == par.string.bytesize && split_bytes == trailed.bytesize
+[[big, 2], [big, 3], [big.grayscale, 2], [big.grayscale, 3]].each do |im, rows|
+  io = StringIO.new("".b)
+  JPEG.write(im, io, progressive: false, optimize: false, restart_rows: rows)
+  a = JPEG.read(StringIO.new(io.string))
+  b = JPEG.read(StringIO.new(io.string), threads: 4)
+  raise "parallel decoding of %s, restart_rows %d failed" % [im.gray?? "gray" : "4:2:0", rows] unless a.raw_data == b.raw_data
+end
+io = StringIO.new("".b)
+JPEG.write(big, io)
+planes = JPEG.read(StringIO.new(io.string), raw: :ycbcr)
+w, h = big.width, big.height
+planes.planes = planes.planes.each_with_index.map do |plane, c|
+  next plane if c == 0
+  (0...h).map { |y| plane[(y / 2) * planes.strides[c], (w + 1) / 2].each_char.map { |ch| ch * 2 }.join[0, w] }.join
+end
+planes.strides = [planes.strides[0], w, w]
+planes.sampling = [[1, 1], [1, 1], [1, 1]]
+[1, 3].each do |rows|
+  io = StringIO.new("".b)
+  JPEG.write(planes, io, progressive: false, optimize: false, restart_rows: rows)
+  raise "4:4:4 write failed" unless JPEG.read(StringIO.new(io.string), raw: :ycbcr).sampling == [[1, 1], [1, 1], [1, 1]]
+  a = JPEG.read(StringIO.new(io.string))
+  b = JPEG.read(StringIO.new(io.string), threads: 4)
+  raise "parallel decoding of 4:4:4, restart_rows %d failed" % rows unless a.raw_data == b.raw_data
+end
+
+planes = JPEG.read(StringIO.new(ser.string), raw: :ycbcr)
+puts "planes   : %s, strides %s" % [planes.sampling.inspect, planes.strides.inspect]
+raise "raw read failed" unless planes.planes.size == 3 && planes.planes[0].size == planes.strides[0] * big.height
+io = StringIO.new("".b)
+JPEG.write(big.grayscale, io)
+planes = JPEG.read(StringIO.new(io.string), raw: :ycbcr)
+planes.quality = 95
+raise "raw gray read failed" unless planes.planes == [JPEG.read(StringIO.new(io.string)).raw_data]
+# APP14 of Adobe with transform 0 makes a file without JFIF marker RGB
+adobe = "Adobe".b + [100, 0, 0].pack("nnn") + "\0".b
+exif_file = File.binread(File.join(dir, "test.jpg"))
+rgb_file = exif_file[0, 2] + "\xFF\xEE".b + [adobe.bytesize + 2].pack("n") + adobe + exif_file[2..-1]
+raise "raw read of RGB failed" unless (JPEG.read(rgb_file, raw: :ycbcr) rescue $!.class) == JPEG::StandardError
+io = StringIO.new("".b)
+JPEG.write(planes, io)
+img = JPEG.read(StringIO.new(io.string))
+raise "raw write failed" unless img.gray? && img.width == big.width && img.height == big.height
+color = JPEG.read(StringIO.new(ser.string), raw: :ycbcr)
+color.quality = 95
+io = StringIO.new("".b)
+JPEG.write(color, io)
+img = JPEG.read(StringIO.new(io.string))
+expected = JPEG.read(StringIO.new(ser.string)).raw_data.unpack("C*")
+actual = img.raw_data.unpack("C*")
+diff = (0...expected.size).step(97).sum { |i| (expected[i] - actual[i]).abs } / (expected.size / 97.0)
+puts "planes   : color 4:2:0 written back, mean difference %.2f" % diff
+raise "raw color write failed" unless !img.gray? && img.width == big.width && img.height == big.height && diff < 3
+
+rgb = JPEG.read(StringIO.new(ser.string))
+bgra = JPEG.read(StringIO.new(ser.string), format: :bgra)
+swapped = bgra.raw_data.unpack("C*").each_slice(4).map { |b, g, r, a| [r, g, b] }.flatten.pack("C*")
+puts "format   : %s, %d bytes, same as rgb: %s" % [bgra.format, bgra.raw_data.size, swapped == rgb.raw_data]
+raise "4 byte format failed" unless swapped == rgb.raw_data
+raise "4 byte alpha failed" unless bgra.level(10, 90, true).raw_data.unpack("C*").each_slice(4).all? { |px| px[3] == 255 }
+io = StringIO.new("".b)
+JPEG.write(bgra, io, progressive: false, optimize: false, restart_rows: 1)
+io2 = StringIO.new("".b)
+JPEG.write(rgb, io2, progressive: false, optimize: false, restart_rows: 1)
+raise "4 byte write failed" unless io.string == io2.string
+raise "4 byte kernels failed" unless bgra.bicubic(100, 100).raw_data.size == 100 * 100 * 4
+
+forged = ser.string.b
+sof = forged.index("\xFF\xC0".b)
+forged[sof + 5, 4] = [60000, 60000].pack("nn")
+JPEG.max_pixels = 50_000_000
+begin
+  JPEG.read(StringIO.new(forged))
+  raise "max_pixels failed"
+rescue JPEG::LimitError => e
+  puts "limit    : #{e.message}"
+end
+JPEG.max_pixels = 0
+begin
+  JPEG::Reader.new(StringIO.new(ser.string), limit: 1000)
+  raise "limit failed"
+rescue JPEG::LimitError
+end
+raise "max_memory failed" unless JPEG.read(StringIO.new(ser.string), max_memory: 100_000_000).width == big.width
+
+cache = JPEG::Cache.new(big.raw_data.size)
+thumb = cache.fetch(ser.string, [:bilinear, 320, 240], :grayscale)
+thumb.raw_data[0] = "x"
+again = cache.fetch(ser.string, [:bilinear, 320, 240], :grayscale)
+other = cache.fetch(ser.string, [:bilinear, 160, 120])
+puts "cache    : %s" % cache.stats.inspect
+raise "cache failed" unless again.raw_data == JPEG.read(ser.string).bilinear(320, 240).grayscale.raw_data
+raise "cache counters failed" unless cache.hits == 1 && cache.misses == 2 && cache.bytes <= cache.max_bytes
+cache.fetch(ser.string, [:bilinear, 160, 120], format: :bgra, auto_orient: true)
+cache.fetch(ser.string, [:bilinear, 160, 120], auto_orient: true, threads: 4, format: :bgra)
+raise "cache key of options failed" unless cache.hits == 2 && cache.misses == 3
+
+dumped = File.join(dir, "test.img")
+bgra.dump(dumped)
+mapped = JPEG::Image.mmap(dumped)
+shared = JPEG.read(ser.string, shared: true)
+puts "mmap     : %d x %d %s, %d bytes" % [mapped.width, mapped.height, mapped.format, File.size(dumped)]
+raise "mmap failed" unless mapped.raw_data == bgra.raw_data && mapped.format == :bgra
+raise "shared failed" unless shared.raw_data == rgb.raw_data && shared.bicubic(100, 100).width == 100
+mapped.raw_data[0] = "\0"
+raise "copy on write failed" unless JPEG::Image.mmap(dumped).raw_data == bgra.raw_data
+part = JPEG::Image.mmap(dumped).raw_data[4, 4000]
+GC.start
+raise "mapping owner failed" unless part == bgra.raw_data[4, 4000]
+if File.exist?("/proc/self/maps")
+  mappings = proc { File.readlines("/proc/self/maps").count { |l| l.include?(File.expand_path(dumped)) } }
+  8.times { JPEG::Image.mmap(dumped).raw_data.sum }
+  GC.start
+  puts "mmap     : %d of 8 mappings left after GC" % mappings.call
+  raise "munmap failed" unless mappings.call < 8
+end
+File.unlink(dumped)
+
+thumb = rgb.bicubic(320, 240)
+sharp = rgb.bicubic(320, 240, sharpen: {amount: 1.0, radius: 1.5, threshold: 2})
+puts "unsharp  : %d x %d" % [sharp.width, sharp.height]
+raise "sharpen failed" unless sharp.raw_data == thumb.unsharp(1.0, 1.5, 2).raw_data
+raise "resize options check failed" unless (rgb.bilinear(10, 10, 5) rescue $!.class) == TypeError
+raise "unsharp failed" unless thumb.unsharp(0).raw_data == thumb.raw_data && thumb.unsharp.raw_data != thumb.raw_data
+raise "unsharp alpha failed" unless bgra.bilinear(80, 60, sharpen: true).raw_data.unpack("C*").each_slice(4).all? { |px| px[3] == 255 }
+
+if defined?(Ractor)
+  Warning[:experimental] = false
+  shareable = Ractor.make_shareable(JPEG.read(ser.string))
+  ractors = 2.times.map do |i|
+    Ractor.new(shareable, ser.string.dup.freeze) do |img, data|
+      [img.bicubic(64, 48).raw_data, JPEG.read(data).width, JPEG.stats["bicubic"][:calls]]
+    end
+  end
+  results = ractors.map(&:take)
+  puts "ractor   : %d ractors" % results.size
+  raise "ractor failed" unless results.all? { |r| r == [shareable.bicubic(64, 48).raw_data, shareable.width, 0] }
+  raise "ractor config failed" unless Ractor.new { begin; JPEG.max_pixels = 1; rescue; $!.class; end }.take == Ractor::UnsafeError
+end
+
+# APP1 with IFD0 of Orientation 6 (rotate 90 degrees)
+exif = "Exif\0\0MM\0\x2a\0\0\0\x08\0\x01\x01\x12\0\x03\0\0\0\x01\0\x06\0\0\0\0\0\0".b
+oriented = par.string[0, 2] + "\xFF\xE1".b + [exif.bytesize + 2].pack("n") + exif + par.string[2..-1]
+upright = JPEG.read(oriented, auto_orient: true, threads: 4)
+puts "orient   : %d x %d -> %d x %d" % [rgb.width, rgb.height, upright.width, upright.height]
+raise "auto_orient failed" unless upright.raw_data == JPEG.read(par.string).rotate(90).raw_data && upright.width == rgb.height
+raise "orientation ignored failed" unless JPEG.read(oriented).width == rgb.width
+base = JPEG.read(par.string)
+corner = proc { |im, x, y| im.raw_data[(y * im.width + x) * 3, 3] }
+raise "orientation 6 failed" unless corner[upright, 0, 0] == corner[base, 0, base.height - 1] && corner[upright, upright.width - 1, 0] == corner[base, 0, 0]
+tiny = JPEG::Image.new
+tiny.raw_data = [1, 2, 3, 4, 5, 6].pack("C*")
+tiny.width = 3
+tiny.height = 2
+tiny.format = :gray
+turned = tiny.rotate(90)
+raise "rotate 90 failed" unless turned.raw_data.unpack("C*") == [4, 1, 5, 2, 6, 3] && turned.width == 2 && turned.height == 3
+tiny.raw_data = "\x01".b
+raise "rotate of short raw_data failed" unless (tiny.rotate(90) rescue $!.class) == ArgumentError
+raise "rotate failed" unless rgb.rotate(90).rotate(270).raw_data == rgb.raw_data && rgb.rotate(90).rotate(90).raw_data == rgb.rotate(180).raw_data
+raise "flip failed" unless rgb.flip.flop.raw_data == rgb.rotate(180).raw_data && bgra.flip.flip.raw_data == bgra.raw_data
+
+passes = []
+JPEG.write(rgb, StringIO.new("".b), progress: lambda { |done, total, row, rows| passes << [done, total] })
+rows = 0
+cancelled = begin
+  JPEG.read(ser.string, cancel: lambda { (rows += 1) > 10 })
+rescue JPEG::Cancelled
+  true
+end
+expired = begin
+  JPEG.read(ser.string, deadline: 0)
+rescue JPEG::Cancelled
+  $!.message
+end
+puts "progress : %d passes, cancelled at row %d, %s" % [passes.uniq.size, rows, expired]
+raise "progress failed" unless passes.uniq.size > 1 && passes.last[0] == passes.last[1] - 1
+raise "cancel failed" unless cancelled == true && rows == 11 && expired == "deadline exceeded"
+raise "deadline failed" unless JPEG.read(ser.string, deadline: Time.now + 60).raw_data == rgb.raw_data
+partial = "x".b
+begin
+  JPEG.write(rgb, partial, cancel: lambda { true })
+rescue JPEG::Cancelled
+end
+raise "cancelled write to String failed" unless partial == "x"
+
+recompressed = StringIO.new("".b)
+rgb.quality = 40
+JPEG.write(rgb.bicubic(rgb.width / 3, rgb.height / 3), recompressed)
+rgb.quality = 100
+distances = %i[ahash dhash phash].map do |kind|
+  a = JPEG.fingerprint(ser.string, kind: kind)
+  b = JPEG.fingerprint(StringIO.new(recompressed.string), kind: kind)
+  c = JPEG.fingerprint(StringIO.new(ser.string), kind: kind)
+  raise "fingerprint failed" unless a == c && a.between?(0, 2**64 - 1)
+  (a ^ b).to_s(2).count("1")
+end
+puts "fingerprint: distances %s" % distances.inspect
+raise "fingerprint distance failed" unless distances.all? { |d| d <= 8 }
+raise "fingerprint default failed" unless JPEG.fingerprint(ser.string) == JPEG.fingerprint(ser.string, kind: :phash)
+
+full = JPEG.encode(rgb)
+written = StringIO.new("".b)
+JPEG.write(rgb, written)
+raise "encode failed" unless full == written.string
+appended = "x".b
+JPEG.write(rgb, appended, quality: 50)
+raise "write(String) failed" unless appended[0] == "x" && JPEG.read(appended[1..]).width == rgb.width
+sizes = [full.bytesize / 3, full.bytesize / 8].map do |budget|
+  data = JPEG.encode(rgb, max_bytes: budget)
+  raise "encode(max_bytes) failed" unless data.bytesize <= budget && JPEG.read(data).width == rgb.width
+  data.bytesize
+end
+puts "encode   : %d bytes, %s within budgets" % [full.bytesize, sizes.inspect]
+raise "encode quality failed" unless sizes[0] > sizes[1]
+tiny = begin
+  JPEG.encode(rgb, max_bytes: 100, min_quality: 10)
+rescue JPEG::LimitError
+  true
+end
+raise "encode limit failed" unless tiny == true
+thumb = rgb.bilinear(96, 72)
+by_quality = (1..100).map { |q| JPEG.encode(thumb, quality: q).bytesize }
+missed = (by_quality.min..by_quality.max).step((by_quality.max - by_quality.min) / 60).reject do |budget|
+  best = (1..100).select { |q| by_quality[q - 1] <= budget }.max
+  JPEG.encode(thumb, max_bytes: budget, max_quality: 100).bytesize == by_quality[best - 1]
+end
+raise "encode(max_bytes) is beaten by the exhaustive search at #{missed.inspect}" unless missed.empty?
+
+small = rgb.bilinear(64, 48)
+small.quality = 80
+mjpeg = StringIO.new("".b)
+JPEG::Encoder.open(mjpeg, progressive: false) do |encoder|
+  encoder << small << small.grayscale
+  encoder.write(small.rotate(90))
+  raise "Encoder#frames failed" unless encoder.frames == 3
+end
+frames = [small, small.grayscale, small.rotate(90)].map { |img| JPEG.encode(img, progressive: false) }
+raise "Encoder failed" unless mjpeg.string == frames.join
+raise "Encoder#encode failed" unless JPEG::Encoder.new(quality: 80).encode(small) == JPEG.encode(small)
+stream = frames[0] + "\r\n--frame\r\n\r\n" + frames[1][0, frames[1].bytesize / 2] + frames[2] + frames[1]
+buffer = JPEG::Image.new
+decoded = [StringIO.new(stream), stream].map do |src|
+  decoder = JPEG::Decoder.new(src, buffer_size: 64)
+  first = decoder.read
+  broken = begin
+    decoder.read
+  rescue JPEG::StandardError
+    true
+  end
+  raise "Decoder#read(img) failed" unless decoder.read(buffer).equal?(buffer)
+  rest = decoder.each_frame { |img| raise "Decoder#each_frame failed" unless img.gray? }
+  raise "Decoder failed" unless broken == true && rest == 1 && decoder.read.nil? && decoder.frames == 3
+  decoder.close
+  [first.raw_data, buffer.width, buffer.height]
+end
+over = JPEG.encode(rgb.bilinear(128, 96)) + frames[0] + frames[0]
+limited = [StringIO.new(over), over].map do |src|
+  decoder = JPEG::Decoder.new(src, limit: 5000)
+  skipped = begin
+    decoder.read
+  rescue JPEG::LimitError
+    true
+  end
+  [skipped, decoder.read&.width, decoder.read&.width, decoder.read]
+end
+raise "Decoder limit failed" unless limited.uniq == [[true, 64, 64, nil]]
+puts "decoder  : %d frames of %d bytes" % [frames.size, mjpeg.string.bytesize]
+raise "Decoder failed" unless decoded.uniq == [[JPEG.read(frames[0]).raw_data, 48, 64]]
+
 puts "benchmarks"
 require "benchmark"
 